@@ -0,0 +1,185 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/cache.h>
+#include <linux/debugfs.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <net/ipv6.h>
+
+#include "access_log.h"
+
+#define DEFAULT_ACCESS_LOG_SIZE 1024
+
+static unsigned int access_log_size = DEFAULT_ACCESS_LOG_SIZE;
+module_param(access_log_size, uint, 0444);
+MODULE_PARM_DESC(access_log_size, "access log records per CPU, 0 disables");
+
+/* Single-producer single-consumer ring: only the owning CPU, with
+ * preemption disabled, advances @head; only the reader advances @tail.
+ */
+struct access_log_ring {
+    unsigned long head;
+    unsigned long dropped;
+    struct access_log_record *records;
+    unsigned long tail ____cacheline_aligned;
+};
+
+static DEFINE_PER_CPU(struct access_log_ring, access_log_rings);
+static DEFINE_MUTEX(access_log_reader);
+static unsigned long access_log_mask;
+
+static int access_log_dropped_get(char *buffer, const struct kernel_param *kp)
+{
+    unsigned long dropped = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        dropped += READ_ONCE(per_cpu_ptr(&access_log_rings, cpu)->dropped);
+    return scnprintf(buffer, PAGE_SIZE, "%lu\n", dropped);
+}
+
+static const struct kernel_param_ops access_log_dropped_ops = {
+    .get = access_log_dropped_get,
+};
+module_param_cb(access_log_dropped, &access_log_dropped_ops, NULL, 0444);
+MODULE_PARM_DESC(access_log_dropped, "records dropped because a ring was full");
+
+/* Never blocks: when the reader falls behind, the record is counted and
+ * dropped rather than stalling the request.
+ */
+void access_log_add(const struct sockaddr *peer,
+                    unsigned int method,
+                    const char *url,
+                    unsigned int status,
+                    u64 bytes,
+                    u64 start)
+{
+    struct access_log_ring *ring;
+    struct access_log_record *rec;
+    unsigned long head;
+    size_t url_len;
+
+    if (!access_log_mask)
+        return;
+
+    ring = get_cpu_ptr(&access_log_rings);
+    head = ring->head;
+    if (head - smp_load_acquire(&ring->tail) > access_log_mask) {
+        ring->dropped++;
+        goto out;
+    }
+
+    rec = &ring->records[head & access_log_mask];
+    rec->timestamp = ktime_get_real_ns();
+    rec->latency = ktime_get_ns() - start;
+    rec->bytes = bytes;
+    if (peer->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) peer;
+        ipv6_addr_set_v4mapped(sin->sin_addr.s_addr,
+                               (struct in6_addr *) rec->addr);
+        rec->port = ntohs(sin->sin_port);
+    } else if (peer->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) peer;
+        memcpy(rec->addr, &sin6->sin6_addr, sizeof(rec->addr));
+        rec->port = ntohs(sin6->sin6_port);
+    } else {
+        memset(rec->addr, 0, sizeof(rec->addr));
+        rec->port = 0;
+    }
+    rec->status = status;
+    rec->method = method;
+    url_len = strnlen(url, ACCESS_LOG_URL_LEN);
+    rec->url_len = url_len;
+    memcpy(rec->url, url, url_len);
+    memset(rec->url + url_len, 0, ACCESS_LOG_URL_LEN - url_len);
+    smp_store_release(&ring->head, head + 1);
+out:
+    put_cpu_ptr(&access_log_rings);
+}
+
+/* Drain whole records from every CPU's ring; returns 0 when all are empty */
+static ssize_t access_log_read(struct file *file,
+                               char __user *buf,
+                               size_t count,
+                               loff_t *ppos)
+{
+    const size_t size = sizeof(struct access_log_record);
+    size_t done = 0;
+    int cpu, err = 0;
+
+    if (count < size)
+        return -EINVAL;
+
+    mutex_lock(&access_log_reader);
+    for_each_possible_cpu (cpu) {
+        struct access_log_ring *ring = per_cpu_ptr(&access_log_rings, cpu);
+        unsigned long head = smp_load_acquire(&ring->head);
+        unsigned long tail = ring->tail;
+
+        while (tail != head && count - done >= size) {
+            if (copy_to_user(buf + done,
+                             &ring->records[tail & access_log_mask], size)) {
+                err = -EFAULT;
+                break;
+            }
+            done += size;
+            tail++;
+        }
+        /* hand the slots back to the producer only once copied out */
+        smp_store_release(&ring->tail, tail);
+        if (err || count - done < size)
+            break;
+    }
+    mutex_unlock(&access_log_reader);
+    return done ? done : err;
+}
+
+static const struct file_operations access_log_fops = {
+    .owner = THIS_MODULE,
+    .open = nonseekable_open,
+    .read = access_log_read,
+};
+
+int access_log_init(struct dentry *dir)
+{
+    unsigned long nr;
+    int cpu;
+
+    if (!access_log_size)
+        return 0;
+
+    nr = roundup_pow_of_two(access_log_size);
+    for_each_possible_cpu (cpu) {
+        struct access_log_ring *ring = per_cpu_ptr(&access_log_rings, cpu);
+        ring->records =
+            kvzalloc_node(array_size(nr, sizeof(*ring->records)), GFP_KERNEL,
+                          cpu_to_node(cpu));
+        if (!ring->records) {
+            access_log_exit();
+            return -ENOMEM;
+        }
+    }
+    access_log_mask = nr - 1;
+    debugfs_create_file("access_log", 0400, dir, NULL, &access_log_fops);
+    return 0;
+}
+
+void access_log_exit(void)
+{
+    int cpu;
+
+    access_log_mask = 0;
+    for_each_possible_cpu (cpu) {
+        struct access_log_ring *ring = per_cpu_ptr(&access_log_rings, cpu);
+        kvfree(ring->records);
+        ring->records = NULL;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef KHTTPD_ACCESS_LOG_H
+#define KHTTPD_ACCESS_LOG_H
+
+#include <linux/types.h>
+
+#define ACCESS_LOG_URL_LEN 80
+
+/* One binary access log record, as returned by reading the access_log file
+ * in khttpd's debugfs directory. read() hands out whole records only.
+ */
+struct access_log_record {
+    __u64 timestamp; /* CLOCK_REALTIME in ns when the response was sent */
+    __u64 latency;   /* ns from the first request byte to the last sent */
+    __u64 bytes;     /* response bytes sent */
+    __u8 addr[16];   /* client address, IPv4 as v4-mapped IPv6 */
+    __u16 port;      /* client port, host byte order */
+    __u16 status;
+    __u8 method; /* enum http_method */
+    __u8 url_len; /* bytes of url used, the URL may be truncated */
+    __u8 reserved[2];
+    char url[ACCESS_LOG_URL_LEN];
+};
+
+#ifdef __KERNEL__
+#include <linux/dcache.h>
+#include <linux/socket.h>
+
+extern int access_log_init(struct dentry *dir);
+extern void access_log_exit(void);
+extern void access_log_add(const struct sockaddr *peer,
+                           unsigned int method,
+                           const char *url,
+                           unsigned int status,
+                           u64 bytes,
+                           u64 start);
+#endif
+#endif
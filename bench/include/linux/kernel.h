@@ -0,0 +1,14 @@
+/* Userspace stand-in for the kernel headers used by the request parsers */
+#ifndef BENCH_LINUX_KERNEL_H
+#define BENCH_LINUX_KERNEL_H
+
+#include <limits.h>
+#include <stddef.h>
+
+#include <linux/types.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define fallthrough __attribute__((__fallthrough__))
+#endif
@@ -0,0 +1 @@
+/* Dummy */
@@ -0,0 +1,6 @@
+#ifndef BENCH_LINUX_STRING_H
+#define BENCH_LINUX_STRING_H
+
+#include <string.h>
+#include <strings.h>
+#endif
@@ -0,0 +1,8 @@
+#ifndef BENCH_LINUX_TYPES_H
+#define BENCH_LINUX_TYPES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#endif
@@ -0,0 +1,326 @@
+/* Compare http_parser with the fast request parser on request corpora.
+ *
+ * Each corpus file holds requests back to back, the way a client pipelines
+ * them. Lines may end in LF only and are turned into CRLF on loading.
+ * Every corpus is first parsed by both, checking that they agree on each
+ * request, then timed with each parser alone and with the fast path taking
+ * what it can, as the server does.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../http_fastparse.h"
+#include "../http_parser.h"
+
+#define DEFAULT_ROUNDS 2000
+#define MAX_REQUESTS 4096
+
+struct corpus {
+    const char *name;
+    char *data;
+    size_t len;
+};
+
+/* What the server takes from a request */
+struct bench_request {
+    enum http_method method;
+    bool http11;
+    bool keep_alive;
+    struct http_slice url;
+    struct http_slice headers[NR_HTTP_HEADERS];
+};
+
+struct bench_state {
+    struct http_parser parser;
+    struct bench_request *requests; /* NULL when only timing */
+    size_t nr;
+    struct http_slice url, field, headers[NR_HTTP_HEADERS];
+    int header;
+    bool in_value;
+    bool pending; /* the general parser is inside a message */
+};
+
+static void slice_append(struct http_slice *slice, const char *p, size_t len)
+{
+    if (!slice->len)
+        slice->p = (char *) p;
+    slice->len += len;
+}
+
+static int on_message_begin(http_parser *parser)
+{
+    struct bench_state *s = parser->data;
+
+    memset(&s->url, 0, sizeof(s->url));
+    memset(&s->field, 0, sizeof(s->field));
+    memset(s->headers, 0, sizeof(s->headers));
+    s->in_value = false;
+    s->pending = true;
+    return 0;
+}
+
+static int on_url(http_parser *parser, const char *p, size_t len)
+{
+    struct bench_state *s = parser->data;
+    slice_append(&s->url, p, len);
+    return 0;
+}
+
+static int on_header_field(http_parser *parser, const char *p, size_t len)
+{
+    struct bench_state *s = parser->data;
+
+    if (s->in_value) {
+        s->in_value = false;
+        s->field.len = 0;
+    }
+    slice_append(&s->field, p, len);
+    return 0;
+}
+
+static int on_header_value(http_parser *parser, const char *p, size_t len)
+{
+    struct bench_state *s = parser->data;
+
+    if (!s->in_value) {
+        s->in_value = true;
+        s->header = http_header_lookup(s->field.p, s->field.len);
+        if (s->header >= 0 && s->headers[s->header].len)
+            s->header = -1;
+    }
+    if (s->header >= 0)
+        slice_append(&s->headers[s->header], p, len);
+    return 0;
+}
+
+static void record(struct bench_state *s,
+                   enum http_method method,
+                   bool http11,
+                   bool keep_alive,
+                   const struct http_slice *url,
+                   const struct http_slice *headers)
+{
+    struct bench_request *req;
+
+    if (s->requests && s->nr < MAX_REQUESTS) {
+        req = &s->requests[s->nr];
+        req->method = method;
+        req->http11 = http11;
+        req->keep_alive = keep_alive;
+        req->url = *url;
+        memcpy(req->headers, headers, sizeof(req->headers));
+    }
+    s->nr++;
+}
+
+static int on_message_complete(http_parser *parser)
+{
+    struct bench_state *s = parser->data;
+
+    record(s, parser->method, parser->http_major == 1 && parser->http_minor,
+           http_should_keep_alive(parser), &s->url, s->headers);
+    s->pending = false;
+    /* hand the next request back to the fast path */
+    http_parser_pause(parser, 1);
+    return 0;
+}
+
+static const struct http_parser_settings settings = {
+    .on_message_begin = on_message_begin,
+    .on_url = on_url,
+    .on_header_field = on_header_field,
+    .on_header_value = on_header_value,
+    .on_message_complete = on_message_complete,
+};
+
+/* Parse @c, the same way the server's worker does when @fast is set;
+ * returns the number of bytes the general parser saw.
+ */
+static size_t parse(struct bench_state *s, const struct corpus *c, bool fast)
+{
+    char *p = c->data;
+    size_t len = c->len, general = 0;
+
+    http_parser_init(&s->parser, HTTP_REQUEST);
+    s->parser.data = s;
+    s->nr = 0;
+    s->pending = false;
+    while (len) {
+        size_t n;
+
+        if (fast && !s->pending) {
+            struct http_fast_request req;
+            int ret = http_fast_parse(p, len, &req);
+            if (ret > 0) {
+                record(s, req.method, req.http11, req.keep_alive, &req.url,
+                       req.headers);
+                p += ret;
+                len -= ret;
+                continue;
+            }
+        }
+        n = http_parser_execute(&s->parser, &settings, p, len);
+        general += n;
+        if (HTTP_PARSER_ERRNO(&s->parser) == HPE_PAUSED) {
+            http_parser_pause(&s->parser, 0);
+        } else if (HTTP_PARSER_ERRNO(&s->parser) != HPE_OK || n < len) {
+            /* upgrades stop the parser too, the server has no use for them */
+            fprintf(stderr, "%s: %s at byte %zu\n", c->name,
+                    http_errno_description(HTTP_PARSER_ERRNO(&s->parser)),
+                    (size_t) (p + n - c->data));
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+    return general;
+}
+
+static bool slice_equal(const struct http_slice *a, const struct http_slice *b)
+{
+    return a->len == b->len && !memcmp(a->p, b->p, a->len);
+}
+
+static void check(const struct corpus *c, size_t *nr, size_t *general)
+{
+    static struct bench_request slow_reqs[MAX_REQUESTS];
+    static struct bench_request fast_reqs[MAX_REQUESTS];
+    struct bench_state slow = {.requests = slow_reqs};
+    struct bench_state fast = {.requests = fast_reqs};
+
+    parse(&slow, c, false);
+    *general = parse(&fast, c, true);
+    if (slow.nr != fast.nr) {
+        fprintf(stderr, "%s: %zu requests, but %zu with the fast path\n",
+                c->name, slow.nr, fast.nr);
+        exit(1);
+    }
+    for (size_t i = 0; i < slow.nr && i < MAX_REQUESTS; i++) {
+        const struct bench_request *a = &slow_reqs[i], *b = &fast_reqs[i];
+        bool same = a->method == b->method && a->http11 == b->http11 &&
+                    a->keep_alive == b->keep_alive &&
+                    slice_equal(&a->url, &b->url);
+
+        for (int h = 0; h < NR_HTTP_HEADERS; h++)
+            same = same && slice_equal(&a->headers[h], &b->headers[h]);
+        if (!same) {
+            fprintf(stderr, "%s: parsers disagree on request %zu (%.*s)\n",
+                    c->name, i + 1, (int) a->url.len, a->url.p);
+            exit(1);
+        }
+    }
+    *nr = slow.nr;
+}
+
+/* Heads only: the fast parser on its own, skipping what it rejects */
+static size_t parse_fast_only(const struct corpus *c)
+{
+    struct http_fast_request req;
+    char *p = c->data, *end = c->data + c->len;
+    size_t nr = 0;
+
+    while (p < end) {
+        int ret = http_fast_parse(p, end - p, &req);
+        char *next;
+
+        if (ret > 0) {
+            p += ret;
+            nr++;
+            continue;
+        }
+        next = memmem(p, end - p, "\r\n\r\n", 4);
+        if (!next)
+            break;
+        p = next + 4;
+    }
+    return nr;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void load(struct corpus *c, const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    size_t size = 0, cap = 4096;
+    char *raw = malloc(cap);
+    int ch;
+
+    if (!f || !raw) {
+        perror(name);
+        exit(1);
+    }
+    while ((ch = fgetc(f)) != EOF) {
+        if (size + 2 > cap && !(raw = realloc(raw, cap *= 2))) {
+            perror(name);
+            exit(1);
+        }
+        if (ch == '\n' && (!size || raw[size - 1] != '\r'))
+            raw[size++] = '\r';
+        raw[size++] = ch;
+    }
+    fclose(f);
+    c->name = name;
+    c->data = raw;
+    c->len = size;
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = DEFAULT_ROUNDS, opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n')
+            goto usage;
+        rounds = atoi(optarg);
+    }
+    if (optind == argc || rounds <= 0)
+        goto usage;
+
+    printf("%-24s %8s %6s %14s %14s %14s\n", "corpus", "requests", "fast%",
+           "http_parser", "fast heads", "fast path");
+    for (int i = optind; i < argc; i++) {
+        struct bench_state s = {0};
+        struct corpus c;
+        size_t nr, nr_fast, general;
+        double t0, t1, t2, t3;
+
+        load(&c, argv[i]);
+        check(&c, &nr, &general);
+        nr_fast = parse_fast_only(&c);
+
+        t0 = now();
+        for (int r = 0; r < rounds; r++)
+            parse(&s, &c, false);
+        t1 = now();
+        for (int r = 0; r < rounds; r++)
+            parse_fast_only(&c);
+        t2 = now();
+        for (int r = 0; r < rounds; r++)
+            parse(&s, &c, true);
+        t3 = now();
+
+        /* the share of bytes taken by the fast path, then ns per request,
+         * or per head the fast parser accepted
+         */
+        printf("%-24s %8zu %5.1f%% %11.1f ns %11.1f ns %11.1f ns\n", c.name,
+               nr, 100.0 * (c.len - general) / c.len, (t1 - t0) / rounds / nr,
+               nr_fast ? (t2 - t1) / rounds / nr_fast : 0.0,
+               (t3 - t2) / rounds / nr);
+        free(c.data);
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-n rounds] corpus...\n", argv[0]);
+    return 1;
+}
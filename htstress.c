@@ -38,6 +38,7 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdatomic.h>
@@ -254,7 +255,10 @@ static void *worker(void *arg)
                 continue;
             }
 
-            if (evts[n].events & EPOLLHUP) {
+            /* Unix sockets report a server closing after its response as
+             * a hangup, along with the response still to be read
+             */
+            if ((evts[n].events & EPOLLHUP) && !(evts[n].events & EPOLLIN)) {
                 /* This can happen for HTTP/1.0 */
                 fprintf(stderr, "EPOLLHUP\n");
                 exit(1);
@@ -357,7 +361,9 @@ static void print_usage()
         "   -c, --concurrency  number of concurrent connections\n"
         "   -t, --threads      number of threads (set this to the number of "
         "CPU cores)\n"
-        "   -u, --udaddr       path to unix domain socket\n"
+        "   -u, --udaddr       path to unix domain socket, or @name for an "
+        "abstract one\n"
+        "   -4, -6             connect over IPv4 or IPv6 only\n"
         "   -h, --host         host to use for http request\n"
         "   -d, --debug        debug HTTP response\n"
         "   --help             display this message\n");
@@ -516,6 +522,12 @@ int main(int argc, char *argv[])
         ssun->sun_family = PF_UNIX;
         strncpy(ssun->sun_path, udaddr, sizeof(ssun->sun_path) - 1);
         sssln = sizeof(struct sockaddr_un);
+        /* abstract names start with a NUL and have none at the end */
+        if (udaddr[0] == '@') {
+            ssun->sun_path[0] = '\0';
+            sssln = offsetof(struct sockaddr_un, sun_path) +
+                    strnlen(udaddr, sizeof(ssun->sun_path) - 1);
+        }
     }
 
     /* prepare request buffer */
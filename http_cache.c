@@ -0,0 +1,580 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/dcache.h>
+#include <linux/fsnotify_backend.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include "http_cache.h"
+
+#define CACHE_HASH_BITS 12
+#define WATCH_HASH_BITS 10
+#define DEFAULT_CACHE_SIZE (64UL << 20)
+#define DEFAULT_CACHE_OBJECT_MAX (1UL << 20)
+#define DEFAULT_CACHE_TTL 60
+
+static unsigned long cache_size = DEFAULT_CACHE_SIZE;
+module_param(cache_size, ulong, 0444);
+MODULE_PARM_DESC(cache_size, "response cache capacity in bytes, 0 disables");
+static unsigned long cache_object_max = DEFAULT_CACHE_OBJECT_MAX;
+module_param(cache_object_max, ulong, 0444);
+MODULE_PARM_DESC(cache_object_max, "largest body kept in the response cache");
+/* Only a file and its own directory are watched: renaming or replacing a
+ * directory further up leaves the responses from below it cached until
+ * they expire.
+ */
+static unsigned int cache_ttl = DEFAULT_CACHE_TTL;
+module_param(cache_ttl, uint, 0644);
+MODULE_PARM_DESC(cache_ttl, "seconds a cached response stays valid");
+
+struct http_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+/* Lookups walk cache_table under RCU only; cache_lock serializes writers
+ * and owns the CLOCK list, whose head is the clock hand, as well as the
+ * watch table and the dependency lists hanging off it.
+ */
+static DEFINE_HASHTABLE(cache_table, CACHE_HASH_BITS);
+static LIST_HEAD(cache_clock);
+static DEFINE_SPINLOCK(cache_lock);
+static size_t cache_used;
+
+/* Bumped on every invalidation, so that a response read from a file while
+ * the file changed is never published.
+ */
+static unsigned int cache_seq;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define HAVE_CACHE_WATCH
+
+#define WATCH_MASK (FS_MODIFY | FS_ATTRIB | FS_MOVE_SELF | FS_DELETE_SELF)
+
+/* How long a watch outlives the last response depending on it */
+#define WATCH_IDLE_DELAY HZ
+
+/* An fsnotify mark on an inode that cached responses were built from */
+struct http_cache_watch {
+    struct fsnotify_mark mark;
+    struct hlist_node hnode;
+    struct inode *inode;
+    struct list_head deps;
+    struct list_head idle; /* on idle_watches while deps is empty */
+    unsigned long idle_since;
+};
+
+static struct fsnotify_group *watch_group;
+static DEFINE_HASHTABLE(watch_table, WATCH_HASH_BITS);
+static DEFINE_MUTEX(watch_mutex); /* serializes adding and reaping marks */
+
+/* Watches no cached response depends on, the longest idle first. Their
+ * marks pin the inode, so the reaper destroys them after WATCH_IDLE_DELAY.
+ */
+static LIST_HEAD(idle_watches);
+static void http_cache_reap_watches(struct work_struct *work);
+static DECLARE_DELAYED_WORK(watch_reaper, http_cache_reap_watches);
+#endif
+static DEFINE_PER_CPU(struct http_cache_stats, cache_stats);
+
+static int cache_stats_get(char *buffer, const struct kernel_param *kp)
+{
+    struct http_cache_stats sum = {0};
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        const struct http_cache_stats *stats = per_cpu_ptr(&cache_stats, cpu);
+        sum.hits += stats->hits;
+        sum.misses += stats->misses;
+        sum.evictions += stats->evictions;
+    }
+    return scnprintf(buffer, PAGE_SIZE,
+                     "hits %lu misses %lu evictions %lu bytes %zu\n", sum.hits,
+                     sum.misses, sum.evictions, READ_ONCE(cache_used));
+}
+
+static const struct kernel_param_ops cache_stats_ops = {
+    .get = cache_stats_get,
+};
+module_param_cb(cache_stats, &cache_stats_ops, NULL, 0444);
+MODULE_PARM_DESC(cache_stats, "response cache counters");
+
+static u32 http_cache_hash(const char *host,
+                           size_t host_len,
+                           const char *url,
+                           size_t url_len,
+                           enum http_encoding variant)
+{
+    return jhash(url, url_len, jhash(host, host_len, variant));
+}
+
+static bool http_cache_match(const struct http_cache_entry *entry,
+                             const char *host,
+                             size_t host_len,
+                             const char *url,
+                             size_t url_len,
+                             enum http_encoding variant)
+{
+    return entry->variant == variant && entry->host_len == host_len &&
+           entry->key_len == host_len + url_len &&
+           !memcmp(entry->key, host, host_len) &&
+           !memcmp(entry->key + host_len, url, url_len);
+}
+
+static void http_cache_free_rcu(struct rcu_head *rcu)
+{
+    kvfree(container_of(rcu, struct http_cache_entry, rcu));
+}
+
+void http_cache_put(struct http_cache_entry *entry)
+{
+    /* lockless lookups may still be comparing keys, so wait a grace period */
+    if (refcount_dec_and_test(&entry->ref))
+        call_rcu(&entry->rcu, http_cache_free_rcu);
+}
+
+#ifdef HAVE_CACHE_WATCH
+/* Hand @watch to the reaper if nothing depends on it; cache_lock held */
+static void http_cache_release_watch(struct http_cache_watch *watch)
+{
+    if (!list_empty(&watch->deps))
+        return;
+    watch->idle_since = jiffies;
+    list_move_tail(&watch->idle, &idle_watches);
+    schedule_delayed_work(&watch_reaper, WATCH_IDLE_DELAY);
+}
+#else
+static void http_cache_release_watch(struct http_cache_watch *watch) {}
+#endif
+
+/* Drop @entry from the table and the clock; called with cache_lock held */
+static void http_cache_unlink(struct http_cache_entry *entry)
+{
+    for (int i = 0; i < HTTP_CACHE_DEPS; i++) {
+        if (entry->deps[i].watch) {
+            list_del(&entry->deps[i].node);
+            http_cache_release_watch(entry->deps[i].watch);
+            entry->deps[i].watch = NULL;
+        }
+    }
+    hash_del_rcu(&entry->hnode);
+    list_del(&entry->lru);
+    cache_used -= entry->charge;
+    http_cache_put(entry);
+}
+
+/* CLOCK: give referenced entries a second chance, evict the others */
+static void http_cache_evict(void)
+{
+    while (cache_used > cache_size && !list_empty(&cache_clock)) {
+        struct http_cache_entry *entry =
+            list_first_entry(&cache_clock, struct http_cache_entry, lru);
+        if (READ_ONCE(entry->referenced)) {
+            WRITE_ONCE(entry->referenced, false);
+            list_move_tail(&entry->lru, &cache_clock);
+            continue;
+        }
+        http_cache_unlink(entry);
+        this_cpu_inc(cache_stats.evictions);
+    }
+}
+
+#ifdef HAVE_CACHE_WATCH
+static struct http_cache_watch *http_cache_find_watch(struct inode *inode)
+{
+    struct http_cache_watch *watch;
+
+    hash_for_each_possible(watch_table, watch, hnode, (unsigned long) inode)
+    {
+        if (watch->inode == inode)
+            return watch;
+    }
+    return NULL;
+}
+
+/* Drop every response built from @watch's inode; cache_lock held */
+static void http_cache_invalidate(struct http_cache_watch *watch)
+{
+    struct http_cache_dep *dep, *tmp;
+
+    cache_seq++;
+    list_for_each_entry_safe (dep, tmp, &watch->deps, node)
+        http_cache_unlink(dep->entry);
+}
+
+/* Detach @watch's mark, which frees it. The caller holds a reference,
+ * so freeing waits until it is dropped.
+ */
+static void http_cache_destroy_watch(struct http_cache_watch *watch)
+{
+    fsnotify_destroy_mark(&watch->mark, watch_group);
+    fsnotify_put_mark(&watch->mark);
+}
+
+static void http_cache_reap_watches(struct work_struct *work)
+{
+    struct http_cache_watch *watch;
+
+    /* a new mark for the inode must wait until the old one is gone */
+    mutex_lock(&watch_mutex);
+    for (;;) {
+        unsigned long due;
+
+        spin_lock(&cache_lock);
+        watch = list_first_entry_or_null(&idle_watches,
+                                         struct http_cache_watch, idle);
+        due = watch ? watch->idle_since + WATCH_IDLE_DELAY : 0;
+        if (watch && time_before(jiffies, due)) {
+            schedule_delayed_work(&watch_reaper, due - jiffies);
+            watch = NULL;
+        }
+        if (watch) {
+            /* hold the mark while it goes: freeing_mark may run anytime */
+            fsnotify_get_mark(&watch->mark);
+            list_del_init(&watch->idle);
+            hash_del(&watch->hnode);
+        }
+        spin_unlock(&cache_lock);
+        if (!watch)
+            break;
+        http_cache_destroy_watch(watch);
+    }
+    mutex_unlock(&watch_mutex);
+}
+
+static int http_cache_handle_event(struct fsnotify_mark *mark,
+                                   u32 mask,
+                                   struct inode *inode,
+                                   struct inode *dir,
+                                   const struct qstr *file_name,
+                                   u32 cookie)
+{
+    struct http_cache_watch *watch =
+        container_of(mark, struct http_cache_watch, mark);
+
+    spin_lock(&cache_lock);
+    http_cache_invalidate(watch);
+    spin_unlock(&cache_lock);
+    /* the mark pins the inode, so let go once its last name is gone */
+    if ((mask & (FS_MOVE_SELF | FS_DELETE_SELF)) || !inode->i_nlink) {
+        fsnotify_get_mark(mark);
+        http_cache_destroy_watch(watch);
+    }
+    return 0;
+}
+
+/* Called however the mark goes away, including inode eviction and unmount */
+static void http_cache_freeing_mark(struct fsnotify_mark *mark,
+                                    struct fsnotify_group *group)
+{
+    struct http_cache_watch *watch =
+        container_of(mark, struct http_cache_watch, mark);
+
+    spin_lock(&cache_lock);
+    http_cache_invalidate(watch);
+    list_del_init(&watch->idle);
+    hash_del(&watch->hnode);
+    spin_unlock(&cache_lock);
+}
+
+static void http_cache_free_mark(struct fsnotify_mark *mark)
+{
+    kfree(container_of(mark, struct http_cache_watch, mark));
+}
+
+static const struct fsnotify_ops http_cache_fsnotify_ops = {
+    .handle_inode_event = http_cache_handle_event,
+    .freeing_mark = http_cache_freeing_mark,
+    .free_mark = http_cache_free_mark,
+};
+
+static int http_cache_watch_inode(struct inode *inode)
+{
+    struct http_cache_watch *watch;
+    int err = 0;
+
+    spin_lock(&cache_lock);
+    watch = http_cache_find_watch(inode);
+    /* give the caller the full delay to link a response to an idle one */
+    if (watch && !list_empty(&watch->idle))
+        http_cache_release_watch(watch);
+    spin_unlock(&cache_lock);
+    if (watch)
+        return 0;
+
+    mutex_lock(&watch_mutex);
+    spin_lock(&cache_lock);
+    watch = http_cache_find_watch(inode);
+    spin_unlock(&cache_lock);
+    if (watch)
+        goto out;
+
+    watch = kzalloc(sizeof(*watch), GFP_KERNEL);
+    if (!watch) {
+        err = -ENOMEM;
+        goto out;
+    }
+    fsnotify_init_mark(&watch->mark, watch_group);
+    watch->mark.mask = WATCH_MASK;
+    watch->inode = inode;
+    INIT_LIST_HEAD(&watch->deps);
+    INIT_LIST_HEAD(&watch->idle);
+    /* publish first: events may fire as soon as the mark is attached. It
+     * starts out idle, in case no response ever gets linked to it.
+     */
+    spin_lock(&cache_lock);
+    hash_add(watch_table, &watch->hnode, (unsigned long) inode);
+    http_cache_release_watch(watch);
+    spin_unlock(&cache_lock);
+    err = fsnotify_add_inode_mark(&watch->mark, inode, 0);
+    if (err) {
+        spin_lock(&cache_lock);
+        list_del_init(&watch->idle);
+        hash_del(&watch->hnode);
+        spin_unlock(&cache_lock);
+    }
+    /* the attached mark holds its own reference; this drops ours, or frees
+     * the watch if attaching failed
+     */
+    fsnotify_put_mark(&watch->mark);
+out:
+    mutex_unlock(&watch_mutex);
+    return err;
+}
+
+/* Make sure edits to @filp or renames of its directory will invalidate a
+ * response built from it. Call before reading the file, then pass @origin
+ * to http_cache_insert().
+ */
+int http_cache_watch(struct file *filp, struct http_cache_origin *origin)
+{
+    struct dentry *parent = dget_parent(filp->f_path.dentry);
+    int err;
+
+    origin->inodes[0] = file_inode(filp);
+    origin->inodes[1] = d_inode(parent);
+    spin_lock(&cache_lock);
+    origin->seq = cache_seq;
+    spin_unlock(&cache_lock);
+
+    err = http_cache_watch_inode(origin->inodes[0]);
+    if (!err)
+        err = http_cache_watch_inode(origin->inodes[1]);
+    dput(parent);
+    return err;
+}
+
+/* Attach @entry to the watches of @origin; cache_lock held */
+static bool http_cache_link(struct http_cache_entry *entry,
+                            const struct http_cache_origin *origin)
+{
+    struct http_cache_watch *watches[HTTP_CACHE_DEPS];
+
+    /* something changed since the response was read, or a watch is gone */
+    if (origin->seq != cache_seq)
+        return false;
+    for (int i = 0; i < HTTP_CACHE_DEPS; i++) {
+        watches[i] = http_cache_find_watch(origin->inodes[i]);
+        if (!watches[i])
+            return false;
+    }
+    for (int i = 0; i < HTTP_CACHE_DEPS; i++) {
+        entry->deps[i].watch = watches[i];
+        entry->deps[i].entry = entry;
+        list_add(&entry->deps[i].node, &watches[i]->deps);
+        list_del_init(&watches[i]->idle);
+    }
+    return true;
+}
+#else
+/* No inode watches before 5.11: cached responses live out their TTL */
+int http_cache_watch(struct file *filp, struct http_cache_origin *origin)
+{
+    return 0;
+}
+
+static bool http_cache_link(struct http_cache_entry *entry,
+                            const struct http_cache_origin *origin)
+{
+    return true;
+}
+#endif
+
+bool http_cache_admit(size_t size)
+{
+    return cache_size &&
+           size <= min_t(unsigned long, cache_object_max, cache_size);
+}
+
+static struct http_cache_entry *http_cache_find(const char *host,
+                                                size_t host_len,
+                                                const char *url,
+                                                size_t url_len,
+                                                enum http_encoding variant)
+{
+    u32 hash = http_cache_hash(host, host_len, url, url_len, variant);
+    struct http_cache_entry *entry;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(cache_table, entry, hnode, hash)
+    {
+        if (entry->hash != hash ||
+            !http_cache_match(entry, host, host_len, url, url_len, variant))
+            continue;
+        if (time_after(jiffies, entry->expires) ||
+            !refcount_inc_not_zero(&entry->ref))
+            break;
+        if (!READ_ONCE(entry->referenced))
+            WRITE_ONCE(entry->referenced, true);
+        rcu_read_unlock();
+        return entry;
+    }
+    rcu_read_unlock();
+    return NULL;
+}
+
+/* Look up the response cached for @url on @host for requests preferring
+ * @variant. Types that are never compressed are cached once, under the
+ * identity coding, which serves any preference. On a hit the caller owns a
+ * reference and must release it with http_cache_put() once sent.
+ */
+struct http_cache_entry *http_cache_lookup(const char *host,
+                                           const char *url,
+                                           enum http_encoding variant)
+{
+    size_t host_len = strlen(host), url_len = strlen(url);
+    struct http_cache_entry *entry;
+
+    if (!cache_size)
+        return NULL;
+
+    entry = http_cache_find(host, host_len, url, url_len, variant);
+    if (!entry && variant != HTTP_ENCODING_IDENTITY) {
+        entry = http_cache_find(host, host_len, url, url_len,
+                                HTTP_ENCODING_IDENTITY);
+        if (entry && entry->vary) {
+            http_cache_put(entry);
+            entry = NULL;
+        }
+    }
+    if (entry)
+        this_cpu_inc(cache_stats.hits);
+    else
+        this_cpu_inc(cache_stats.misses);
+    return entry;
+}
+
+/* Allocate an entry for @url on @host, as served to requests preferring
+ * @variant, with room for @size response bytes. The body is taken to be
+ * in that coding until the caller says otherwise.
+ */
+struct http_cache_entry *http_cache_alloc(const char *host,
+                                          const char *url,
+                                          enum http_encoding variant,
+                                          size_t size)
+{
+    size_t host_len = strlen(host), url_len = strlen(url);
+    size_t charge = sizeof(struct http_cache_entry) + host_len + url_len + size;
+    struct http_cache_entry *entry;
+
+    entry = kvmalloc(charge, GFP_KERNEL);
+    if (!entry)
+        return NULL;
+    refcount_set(&entry->ref, 1);
+    entry->hash = http_cache_hash(host, host_len, url, url_len, variant);
+    entry->referenced = false;
+    entry->variant = variant;
+    entry->encoding = variant;
+    entry->vary = false;
+    entry->charge = charge;
+    memset(entry->deps, 0, sizeof(entry->deps));
+    entry->hdr_len = 0;
+    entry->len = 0;
+    entry->host_len = host_len;
+    entry->key_len = host_len + url_len;
+    memcpy(entry->key, host, host_len);
+    memcpy(entry->key + host_len, url, url_len);
+    entry->data = entry->key + entry->key_len;
+    return entry;
+}
+
+/* Publish a filled-in @entry built from @origin, replacing any older
+ * response for its key, unless @origin changed meanwhile. The caller keeps
+ * its own reference either way.
+ */
+void http_cache_insert(struct http_cache_entry *entry,
+                       const struct http_cache_origin *origin)
+{
+    struct http_cache_entry *old;
+
+    entry->expires = jiffies + cache_ttl * HZ;
+
+    spin_lock(&cache_lock);
+    if (!http_cache_link(entry, origin))
+        goto out;
+    refcount_inc(&entry->ref);
+    hash_for_each_possible(cache_table, old, hnode, entry->hash)
+    {
+        if (old->hash == entry->hash &&
+            http_cache_match(old, entry->key, entry->host_len,
+                             entry->key + entry->host_len,
+                             entry->key_len - entry->host_len,
+                             entry->variant)) {
+            http_cache_unlink(old);
+            break;
+        }
+    }
+    hash_add_rcu(cache_table, &entry->hnode, entry->hash);
+    list_add_tail(&entry->lru, &cache_clock);
+    cache_used += entry->charge;
+    http_cache_evict();
+out:
+    spin_unlock(&cache_lock);
+}
+
+int http_cache_init(void)
+{
+#ifdef HAVE_CACHE_WATCH
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    watch_group = fsnotify_alloc_group(&http_cache_fsnotify_ops, 0);
+#else
+    watch_group = fsnotify_alloc_group(&http_cache_fsnotify_ops);
+#endif
+    if (IS_ERR(watch_group)) {
+        pr_err("can't allocate fsnotify group\n");
+        return PTR_ERR(watch_group);
+    }
+#endif
+    return 0;
+}
+
+void http_cache_exit(void)
+{
+    struct http_cache_entry *entry, *tmp;
+
+#ifdef HAVE_CACHE_WATCH
+    cancel_delayed_work_sync(&watch_reaper);
+    /* drops every mark; freeing_mark unlinks the watches, rearming the
+     * reaper on the way
+     */
+    fsnotify_destroy_group(watch_group);
+    cancel_delayed_work_sync(&watch_reaper);
+#endif
+    spin_lock(&cache_lock);
+    list_for_each_entry_safe (entry, tmp, &cache_clock, lru)
+        http_cache_unlink(entry);
+    spin_unlock(&cache_lock);
+    /* wait for the RCU callbacks freeing entries before the module goes */
+    rcu_barrier();
+}
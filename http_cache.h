@@ -0,0 +1,81 @@
+#ifndef KHTTPD_HTTP_CACHE_H
+#define KHTTPD_HTTP_CACHE_H
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/types.h>
+
+#include "http_response.h"
+
+#define HTTP_CACHE_DEPS 2
+
+struct http_cache_entry;
+struct http_cache_watch;
+
+/* Link from a cache entry to a watched inode its response was built from */
+struct http_cache_dep {
+    struct list_head node;
+    struct http_cache_watch *watch;
+    struct http_cache_entry *entry;
+};
+
+/* The inodes a response is built from: the file and its directory */
+struct http_cache_origin {
+    struct inode *inodes[HTTP_CACHE_DEPS];
+    unsigned int seq;
+};
+
+/* A fully-formed response: the header block up to, but excluding, the
+ * Date and Connection headers in data[0, hdr_len) followed by the body up
+ * to len. Revalidations are answered from the validator alone.
+ *
+ * Entries are keyed by the coding a request asked for as well, or by
+ * identity for types never compressed; @encoding is what the body actually
+ * is, identity where compressing did not pay.
+ */
+struct http_cache_entry {
+    struct hlist_node hnode;
+    struct list_head lru;
+    struct rcu_head rcu;
+    refcount_t ref;
+    u32 hash;
+    bool referenced;
+    unsigned long expires;
+    size_t charge;
+    struct http_cache_dep deps[HTTP_CACHE_DEPS];
+    struct http_validator validator;
+    const char *mime;
+    enum http_encoding variant;
+    enum http_encoding encoding;
+    bool vary; /* the response depends on Accept-Encoding */
+    size_t hdr_len;
+    size_t len;
+    char *data;
+    size_t host_len;
+    size_t key_len;
+    char key[];
+};
+
+extern int http_cache_init(void);
+extern void http_cache_exit(void);
+extern bool http_cache_admit(size_t size);
+extern struct http_cache_entry *http_cache_lookup(const char *host,
+                                                  const char *url,
+                                                  enum http_encoding variant);
+extern struct http_cache_entry *http_cache_alloc(const char *host,
+                                                 const char *url,
+                                                 enum http_encoding variant,
+                                                 size_t size);
+extern int http_cache_watch(struct file *filp,
+                            struct http_cache_origin *origin);
+extern void http_cache_insert(struct http_cache_entry *entry,
+                              const struct http_cache_origin *origin);
+extern void http_cache_put(struct http_cache_entry *entry);
+
+static inline void http_cache_get(struct http_cache_entry *entry)
+{
+    refcount_inc(&entry->ref);
+}
+#endif
@@ -0,0 +1,133 @@
+#include <linux/crc32.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include <linux/zlib.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "http_compress.h"
+#include "http_stats.h"
+
+#define DEFAULT_COMPRESS_MIN 1024
+#define DEFAULT_COMPRESS_LEVEL 6
+#define COMPRESS_CHUNK PAGE_SIZE
+#define GZIP_HEADER_LEN 10
+#define GZIP_TRAILER_LEN 8
+
+static unsigned int compress_min = DEFAULT_COMPRESS_MIN;
+module_param(compress_min, uint, 0644);
+MODULE_PARM_DESC(compress_min, "smallest body compressed on the fly");
+
+static unsigned int compress_level = DEFAULT_COMPRESS_LEVEL;
+module_param(compress_level, uint, 0644);
+MODULE_PARM_DESC(compress_level,
+                 "zlib level for compressing on the fly, 0 disables it");
+
+/* No file name or mtime, and the OS is Unix */
+static const u8 gzip_header[GZIP_HEADER_LEN] = {0x1f, 0x8b, Z_DEFLATED, 0,
+                                                0,    0,    0,          0,
+                                                0,    3};
+
+bool http_compress_admit(loff_t size)
+{
+    return READ_ONCE(compress_level) && size >= READ_ONCE(compress_min);
+}
+
+/* Feed the file through deflate into @strm's output, which is sized so that
+ * running out of it means the result would not be smaller
+ */
+static int http_compress_stream(struct z_stream_s *strm,
+                                struct file *filp,
+                                loff_t size,
+                                u32 *crc)
+{
+    char *buf = kmalloc(COMPRESS_CHUNK, GFP_KERNEL);
+    loff_t pos = 0;
+    int ret;
+
+    if (!buf)
+        return -ENOMEM;
+    do {
+        ssize_t n = kernel_read(
+            filp, buf, min_t(loff_t, COMPRESS_CHUNK, size - pos), &pos);
+        if (n <= 0) {
+            /* the file shrank under us */
+            ret = n ? n : -EIO;
+            break;
+        }
+        *crc = crc32_le(*crc, buf, n);
+        strm->next_in = buf;
+        strm->avail_in = n;
+        ret = zlib_deflate(strm, pos < size ? Z_NO_FLUSH : Z_FINISH);
+        if (ret == Z_STREAM_END) {
+            ret = 0;
+            break;
+        }
+        ret = ret == Z_OK && strm->avail_out ? 0 : -E2BIG;
+    } while (!ret);
+    kfree(buf);
+    return ret;
+}
+
+ssize_t http_compress_file(struct file *filp,
+                           loff_t size,
+                           enum http_encoding encoding,
+                           char **out)
+{
+    bool gzip = encoding == HTTP_ENCODING_GZIP;
+    size_t header = gzip ? GZIP_HEADER_LEN : 0;
+    size_t trailer = gzip ? GZIP_TRAILER_LEN : 0;
+    struct z_stream_s strm = {0};
+    u32 crc = ~0;
+    char *dst;
+    ssize_t ret;
+
+    if (size <= header + trailer)
+        return -E2BIG;
+    dst = kvmalloc(size, GFP_KERNEL);
+    strm.workspace =
+        kvmalloc(zlib_deflate_workspacesize(MAX_WBITS, MAX_MEM_LEVEL),
+                 GFP_KERNEL);
+    if (!dst || !strm.workspace) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    /* gzip wraps a raw deflate stream itself; deflate means zlib format */
+    if (zlib_deflateInit2(&strm, min(READ_ONCE(compress_level), 9U),
+                          Z_DEFLATED, gzip ? -MAX_WBITS : MAX_WBITS,
+                          DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        ret = -EINVAL;
+        goto out;
+    }
+    memcpy(dst, gzip_header, header);
+    strm.next_out = dst + header;
+    strm.avail_out = size - header - trailer;
+    ret = http_compress_stream(&strm, filp, size, &crc);
+    zlib_deflateEnd(&strm);
+    if (ret < 0)
+        goto out;
+
+    ret = header + strm.total_out;
+    if (gzip) {
+        put_unaligned_le32(~crc, dst + ret);
+        put_unaligned_le32(size, dst + ret + 4);
+        ret += trailer;
+    }
+    http_stats_inc(HTTP_STAT_COMPRESSED);
+    http_stats_add(HTTP_STAT_COMPRESS_IN, size);
+    http_stats_add(HTTP_STAT_COMPRESS_OUT, ret);
+    *out = dst;
+    dst = NULL;
+out:
+    kvfree(strm.workspace);
+    kvfree(dst);
+    return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef KHTTPD_HTTP_COMPRESS_H
+#define KHTTPD_HTTP_COMPRESS_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+#include "http_response.h"
+
+/* Whether a @size byte body is worth compressing on the fly */
+extern bool http_compress_admit(loff_t size);
+
+/* Compress the @size bytes of @filp in @encoding into a new kvmalloc()ed
+ * buffer at @out. Returns its length, -E2BIG if it would not be smaller
+ * than the original, or another negative errno.
+ */
+extern ssize_t http_compress_file(struct file *filp,
+                                  loff_t size,
+                                  enum http_encoding encoding,
+                                  char **out);
+#endif
@@ -0,0 +1,219 @@
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "http_fastparse.h"
+
+#define HTTP_HEADER_NAME(s) {s, sizeof(s) - 1}
+
+static const struct {
+    const char *name;
+    size_t len;
+} http_header_names[NR_HTTP_HEADERS] = {
+    [HTTP_HEADER_HOST] = HTTP_HEADER_NAME("Host"),
+    [HTTP_HEADER_CONNECTION] = HTTP_HEADER_NAME("Connection"),
+    [HTTP_HEADER_ACCEPT_ENCODING] = HTTP_HEADER_NAME("Accept-Encoding"),
+    [HTTP_HEADER_IF_NONE_MATCH] = HTTP_HEADER_NAME("If-None-Match"),
+    [HTTP_HEADER_IF_MODIFIED_SINCE] = HTTP_HEADER_NAME("If-Modified-Since"),
+    [HTTP_HEADER_RANGE] = HTTP_HEADER_NAME("Range"),
+    [HTTP_HEADER_IF_RANGE] = HTTP_HEADER_NAME("If-Range"),
+};
+
+/* Headers changing how the message is framed or kept alive beyond what the
+ * fast path handles
+ */
+static const struct {
+    const char *name;
+    size_t len;
+} http_fallback_names[] = {
+    HTTP_HEADER_NAME("Content-Length"),
+    HTTP_HEADER_NAME("Transfer-Encoding"),
+    HTTP_HEADER_NAME("Upgrade"),
+    HTTP_HEADER_NAME("Proxy-Connection"),
+};
+
+int http_header_lookup(const char *name, size_t len)
+{
+    for (int i = 0; i < NR_HTTP_HEADERS; i++) {
+        if (len == http_header_names[i].len &&
+            !strncasecmp(name, http_header_names[i].name, len))
+            return i;
+    }
+    return -1;
+}
+
+static bool http_fallback_header(const char *name, size_t len)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(http_fallback_names); i++) {
+        if (len == http_fallback_names[i].len &&
+            !strncasecmp(name, http_fallback_names[i].name, len))
+            return true;
+    }
+    return false;
+}
+
+#define ONES (~0UL / 0xff)
+#define HIGHS (ONES * 0x80)
+
+/* Mark the bytes of @x below @n, which is at most 0x80. The lowest marked
+ * byte is exact; borrows may mark some above it.
+ */
+static inline unsigned long http_less(unsigned long x, unsigned int n)
+{
+    return (x - ONES * n) & ~x & HIGHS;
+}
+
+static inline unsigned long http_equal(unsigned long x, unsigned int c)
+{
+    return http_less(x ^ (ONES * c), 1);
+}
+
+/* Find the first byte in [@p, @end) below @lo, equal to @c, DEL or, with
+ * @ascii, above 0x7f. Returns @end if there is none.
+ */
+static char *http_scan(char *p,
+                       char *end,
+                       unsigned int lo,
+                       unsigned int c,
+                       bool ascii)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* a word at a time; the lowest marked byte comes first in memory */
+    while (end - p >= (long) sizeof(unsigned long)) {
+        unsigned long x, mask;
+
+        memcpy(&x, p, sizeof(x));
+        mask = http_less(x, lo) | http_equal(x, c) | http_equal(x, 0x7f);
+        if (ascii)
+            mask |= x & HIGHS;
+        if (mask)
+            return p + __builtin_ctzl(mask) / 8;
+        p += sizeof(x);
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned char ch = *p;
+        if (ch < lo || ch == c || ch == 0x7f || (ascii && ch > 0x7f))
+            return p;
+    }
+    return end;
+}
+
+/* Look for "close" and "keep-alive" in a Connection header's token list */
+static void http_fast_connection(const struct http_slice *value,
+                                 bool *close,
+                                 bool *keep_alive)
+{
+    const char *p = value->p, *end = value->p + value->len;
+
+    while (p < end) {
+        const char *token, *q;
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        token = p;
+        while (p < end && *p != ',')
+            p++;
+        q = p;
+        while (q > token && (q[-1] == ' ' || q[-1] == '\t'))
+            q--;
+        if (q - token == 5 && !strncasecmp(token, "close", 5))
+            *close = true;
+        else if (q - token == 10 && !strncasecmp(token, "keep-alive", 10))
+            *keep_alive = true;
+    }
+}
+
+/* Only well-formed heads of bodiless GET and HEAD requests are taken. On
+ * anything else the general parser runs, and decides whether it is valid.
+ */
+int http_fast_parse(char *buf, size_t len, struct http_fast_request *req)
+{
+    char *p = buf, *end = buf + len, *q;
+    bool close = false, keep_alive = false;
+
+    memset(req, 0, sizeof(*req));
+    if (len >= 4 && !memcmp(p, "GET ", 4)) {
+        req->method = HTTP_GET;
+        p += 4;
+    } else if (len >= 5 && !memcmp(p, "HEAD ", 5)) {
+        req->method = HTTP_HEAD;
+        p += 5;
+    } else {
+        return len < 5 ? 0 : -EINVAL;
+    }
+
+    q = http_scan(p, end, 0x21, ' ', false);
+    if (q == end)
+        return 0;
+    if (*q != ' ' || *p != '/')
+        return -EINVAL;
+    req->url.p = p;
+    req->url.len = q - p;
+
+    p = q + 1;
+    if (end - p < 10)
+        return 0;
+    if (memcmp(p, "HTTP/1.", 7) || (p[7] != '0' && p[7] != '1') ||
+        p[8] != '\r' || p[9] != '\n')
+        return -EINVAL;
+    req->http11 = p[7] == '1';
+    p += 10;
+
+    for (;;) {
+        char *name = p, *value;
+        int id;
+
+        if (end - p < 2)
+            return 0;
+        if (p[0] == '\r') {
+            if (p[1] != '\n')
+                return -EINVAL;
+            p += 2;
+            break;
+        }
+
+        q = http_scan(p, end, 0x21, ':', true);
+        if (q == end)
+            return 0;
+        if (*q != ':' || q == name)
+            return -EINVAL;
+        id = http_header_lookup(name, q - name);
+        if (id < 0 && http_fallback_header(name, q - name))
+            return -EINVAL;
+
+        p = q + 1;
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        value = p;
+        /* values may hold tabs, but no other control character */
+        for (;;) {
+            q = http_scan(p, end, 0x20, 0x7f, false);
+            if (q == end)
+                return 0;
+            if (*q != '\t')
+                break;
+            p = q + 1;
+        }
+        /* a line starting with whitespace would continue the value */
+        if (end - q < 3)
+            return 0;
+        if (q[0] != '\r' || q[1] != '\n' || q[2] == ' ' || q[2] == '\t')
+            return -EINVAL;
+        p = q + 2;
+
+        if (id < 0)
+            continue;
+        if (req->headers[id].p)
+            return -EINVAL;
+        while (q > value && (q[-1] == ' ' || q[-1] == '\t'))
+            q--;
+        req->headers[id].p = value;
+        req->headers[id].len = q - value;
+    }
+
+    http_fast_connection(&req->headers[HTTP_HEADER_CONNECTION], &close,
+                         &keep_alive);
+    req->keep_alive = req->http11 ? !close : keep_alive;
+    return p - buf;
+}
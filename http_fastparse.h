@@ -0,0 +1,44 @@
+#ifndef KHTTPD_HTTP_FASTPARSE_H
+#define KHTTPD_HTTP_FASTPARSE_H
+
+#include <linux/types.h>
+
+#include "http_parser.h"
+
+/* Headers the response path looks at, indexed by their id */
+enum http_header_id {
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    NR_HTTP_HEADERS,
+};
+
+/* A request token, pointing into the buffer the request was read into */
+struct http_slice {
+    char *p;
+    size_t len;
+};
+
+struct http_fast_request {
+    enum http_method method;
+    bool http11; /* HTTP/1.1, rather than 1.0 */
+    bool keep_alive;
+    struct http_slice url;
+    struct http_slice headers[NR_HTTP_HEADERS];
+};
+
+/* The id of the header named by the @len bytes at @name, or -1 */
+extern int http_header_lookup(const char *name, size_t len);
+
+/* Parse the request head at the start of the @len bytes at @buf, if it is a
+ * plain GET or HEAD. Returns the length of the head, 0 if it is incomplete,
+ * or -EINVAL if the request needs the general parser.
+ */
+extern int http_fast_parse(char *buf,
+                           size_t len,
+                           struct http_fast_request *req);
+#endif
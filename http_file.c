@@ -0,0 +1,356 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/cred.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+#include "http_file.h"
+
+#define INDEX_FILE "index.html"
+
+static char *docroot_path;
+static size_t docroot_len;
+
+static bool autoindex;
+module_param(autoindex, bool, 0644);
+MODULE_PARM_DESC(autoindex, "list directories that have no " INDEX_FILE);
+
+struct http_file_type {
+    const char *ext;
+    const char *type;
+    bool compressible;
+};
+
+static const struct http_file_type mime_types[] = {
+    {"html", "text/html; charset=utf-8", true},
+    {"htm", "text/html; charset=utf-8", true},
+    {"css", "text/css", true},
+    {"js", "text/javascript", true},
+    {"mjs", "text/javascript", true},
+    {"json", "application/json", true},
+    {"txt", "text/plain; charset=utf-8", true},
+    {"xml", "application/xml", true},
+    {"svg", "image/svg+xml", true},
+    {"png", "image/png", false},
+    {"jpg", "image/jpeg", false},
+    {"jpeg", "image/jpeg", false},
+    {"gif", "image/gif", false},
+    {"webp", "image/webp", false},
+    {"ico", "image/x-icon", false},
+    {"woff", "font/woff", false},
+    {"woff2", "font/woff2", false},
+    {"ttf", "font/ttf", true},
+    {"wasm", "application/wasm", true},
+    {"pdf", "application/pdf", false},
+    {"zip", "application/zip", false},
+    {"gz", "application/gzip", false},
+    {"mp3", "audio/mpeg", false},
+    {"mp4", "video/mp4", false},
+    {"webm", "video/webm", false},
+};
+
+int http_file_init(const char *docroot)
+{
+    struct path path;
+    int err;
+
+    if (!docroot || !*docroot)
+        return 0;
+
+    err = kern_path(docroot, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &path);
+    if (err) {
+        pr_err("invalid docroot %s, err=%d\n", docroot, err);
+        return err;
+    }
+    path_put(&path);
+
+    docroot_path = kstrdup(docroot, GFP_KERNEL);
+    if (!docroot_path)
+        return -ENOMEM;
+    docroot_len = strlen(docroot_path);
+    while (docroot_len > 1 && docroot_path[docroot_len - 1] == '/')
+        docroot_path[--docroot_len] = '\0';
+    pr_info("serving files from %s\n", docroot_path);
+    return 0;
+}
+
+void http_file_exit(void)
+{
+    kfree(docroot_path);
+    docroot_path = NULL;
+}
+
+bool http_file_enabled(void)
+{
+    return docroot_path;
+}
+
+/* Map @url below the document root into @path, which holds PATH_MAX bytes.
+ * The query string is dropped, %XX escapes are decoded, "." and empty
+ * segments are collapsed and any ".." segment is refused, so the result
+ * never escapes the document root.
+ */
+static int http_file_resolve(const char *url, char *path)
+{
+    size_t len = docroot_len, seg = len;
+
+    if (*url++ != '/')
+        return -EINVAL;
+    memcpy(path, docroot_path, len);
+    path[len++] = '/';
+
+    for (;;) {
+        int c = *url++;
+
+        if (c == '%') {
+            int hi = hex_to_bin(url[0]), lo = hex_to_bin(url[1]);
+            if (hi < 0 || lo < 0)
+                return -EINVAL;
+            c = (hi << 4) | lo;
+            url += 2;
+            if (!c)
+                return -EINVAL;
+        } else if (c == '?' || c == '#') {
+            c = '\0';
+        }
+
+        if (c == '/' || !c) {
+            /* the segment path[seg + 1, len) is complete */
+            size_t n = len - seg - 1;
+            if (n == 2 && !memcmp(path + seg + 1, "..", 2))
+                return -EACCES;
+            if ((n == 1 && path[seg + 1] == '.') || (n == 0 && c))
+                len = seg;
+            if (!c)
+                break;
+            seg = len;
+        }
+        if (len + 1 >= PATH_MAX)
+            return -ENAMETOOLONG;
+        path[len++] = c;
+    }
+    path[len] = '\0';
+    return len;
+}
+
+/* Open @path if it is a regular file or a directory. The type is checked
+ * before the open, so a FIFO never blocks the worker and no device is
+ * opened.
+ */
+static struct file *http_file_open_path(const char *path)
+{
+    struct file *filp;
+    struct path p;
+    umode_t mode;
+    int err;
+
+    err = kern_path(path, LOOKUP_FOLLOW, &p);
+    if (err)
+        return ERR_PTR(err);
+    mode = d_inode(p.dentry)->i_mode;
+    if (S_ISREG(mode) || S_ISDIR(mode))
+        filp = dentry_open(&p, O_RDONLY | O_LARGEFILE, current_cred());
+    else
+        filp = ERR_PTR(-EACCES);
+    path_put(&p);
+    return filp;
+}
+
+/* Append "/" INDEX_FILE to the @len bytes of @path. Returns the new length */
+static int http_file_index(char *path, int len)
+{
+    if (path[len - 1] != '/')
+        path[len++] = '/';
+    if (len + sizeof(INDEX_FILE) > PATH_MAX)
+        return -ENAMETOOLONG;
+    memcpy(path + len, INDEX_FILE, sizeof(INDEX_FILE));
+    return len + sizeof(INDEX_FILE) - 1;
+}
+
+/* Open the regular file @url refers to, using INDEX_FILE for directories,
+ * in which case *@index is set. A directory without one is returned itself
+ * if autoindex is set.
+ */
+struct file *http_file_open(const char *url, bool *index)
+{
+    struct file *filp;
+    char *path;
+    int len;
+
+    *index = false;
+    path = __getname();
+    if (!path)
+        return ERR_PTR(-ENOMEM);
+
+    len = http_file_resolve(url, path);
+    if (len < 0) {
+        filp = ERR_PTR(len);
+        goto out;
+    }
+
+    filp = http_file_open_path(path);
+    if (!IS_ERR(filp) && S_ISDIR(file_inode(filp)->i_mode)) {
+        struct file *dir = filp;
+
+        len = http_file_index(path, len);
+        filp = len < 0 ? ERR_PTR(len) : http_file_open_path(path);
+        if (filp == ERR_PTR(-ENOENT) && READ_ONCE(autoindex)) {
+            filp = dir;
+            goto out;
+        }
+        filp_close(dir, NULL);
+        *index = true;
+    }
+    if (!IS_ERR(filp) && !S_ISREG(file_inode(filp)->i_mode)) {
+        filp_close(filp, NULL);
+        filp = ERR_PTR(-EACCES);
+    }
+out:
+    __putname(path);
+    return filp;
+}
+
+static const struct http_file_type *http_file_type(const struct file *filp)
+{
+    const char *name = filp->f_path.dentry->d_name.name;
+    const char *ext = strrchr(name, '.');
+
+    if (ext) {
+        ext++;
+        for (int i = 0; i < ARRAY_SIZE(mime_types); i++) {
+            if (!strcasecmp(ext, mime_types[i].ext))
+                return &mime_types[i];
+        }
+    }
+    return NULL;
+}
+
+const char *http_file_mime(const struct file *filp)
+{
+    const struct http_file_type *type = http_file_type(filp);
+    return type ? type->type : "application/octet-stream";
+}
+
+/* Whether the file's type is worth a content coding */
+bool http_file_compressible(const struct file *filp)
+{
+    const struct http_file_type *type = http_file_type(filp);
+    return type && type->compressible;
+}
+
+/* Open the file http_file_open() found for @url, with @index as it set it,
+ * named with @suffix appended, such as its precompressed version. The name
+ * is built below the document root like the file's own, so a symlink is
+ * followed only where the file itself would be.
+ */
+struct file *http_file_open_sibling(const char *url,
+                                    bool index,
+                                    const char *suffix)
+{
+    size_t suffix_len = strlen(suffix);
+    struct file *sibling;
+    char *path;
+    int len;
+
+    path = __getname();
+    if (!path)
+        return ERR_PTR(-ENOMEM);
+
+    len = http_file_resolve(url, path);
+    if (len >= 0 && index)
+        len = http_file_index(path, len);
+    if (len < 0) {
+        sibling = ERR_PTR(len);
+        goto out;
+    }
+    if (len + suffix_len >= PATH_MAX) {
+        sibling = ERR_PTR(-ENAMETOOLONG);
+        goto out;
+    }
+    memcpy(path + len, suffix, suffix_len + 1);
+    sibling = http_file_open_path(path);
+    if (!IS_ERR(sibling) && !S_ISREG(file_inode(sibling)->i_mode)) {
+        filp_close(sibling, NULL);
+        sibling = ERR_PTR(-EACCES);
+    }
+out:
+    __putname(path);
+    return sibling;
+}
+
+struct http_file_readdir_ctx {
+    struct dir_context ctx;
+    char *buf;
+    size_t size;
+    size_t used;
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define FILLDIR_CONTINUE true
+#define FILLDIR_STOP false
+static bool http_file_filldir(struct dir_context *ctx,
+#else
+#define FILLDIR_CONTINUE 0
+#define FILLDIR_STOP -ENOSPC
+static int http_file_filldir(struct dir_context *ctx,
+#endif
+                             const char *name,
+                             int namelen,
+                             loff_t offset,
+                             u64 ino,
+                             unsigned int d_type)
+{
+    struct http_file_readdir_ctx *rd =
+        container_of(ctx, struct http_file_readdir_ctx, ctx);
+    struct http_file_dirent *dirent;
+    size_t size = http_file_dirent_size(namelen);
+
+    if (name[0] == '.' &&
+        (namelen == 1 || (namelen == 2 && name[1] == '.')))
+        return FILLDIR_CONTINUE;
+    /* the entry is handed out again by the next call */
+    if (size > rd->size - rd->used)
+        return FILLDIR_STOP;
+    dirent = (struct http_file_dirent *) (rd->buf + rd->used);
+    dirent->len = namelen;
+    dirent->dir = d_type == DT_DIR;
+    memcpy(dirent->name, name, namelen);
+    rd->used += size;
+    return FILLDIR_CONTINUE;
+}
+
+/* Read the next entries of @dir, but "." and "..", into the @size bytes at
+ * @buf. Returns the bytes filled, 0 at the end of the directory, or a
+ * negative errno. Nothing else happens under the directory's lock, so the
+ * caller sends what it got between calls.
+ */
+int http_file_readdir(struct file *dir, char *buf, size_t size)
+{
+    struct http_file_readdir_ctx rd = {
+        .ctx.actor = http_file_filldir,
+        .buf = buf,
+        .size = size,
+    };
+    int err = iterate_dir(dir, &rd.ctx);
+
+    return err < 0 && !rd.used ? err : rd.used;
+}
+
+/* Whether the file's data can be handed out as page-cache pages */
+bool http_file_can_splice(const struct file *filp)
+{
+    const struct address_space *mapping = filp->f_mapping;
+
+    if (IS_DAX(file_inode(filp)))
+        return false;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    return mapping->a_ops->read_folio;
+#else
+    return mapping->a_ops->readpage;
+#endif
+}
@@ -0,0 +1,33 @@
+#ifndef KHTTPD_HTTP_FILE_H
+#define KHTTPD_HTTP_FILE_H
+
+#include <linux/fs.h>
+
+extern int http_file_init(const char *docroot);
+extern void http_file_exit(void);
+extern bool http_file_enabled(void);
+extern struct file *http_file_open(const char *url, bool *index);
+extern const char *http_file_mime(const struct file *filp);
+extern bool http_file_compressible(const struct file *filp);
+extern struct file *http_file_open_sibling(const char *url,
+                                           bool index,
+                                           const char *suffix);
+extern bool http_file_can_splice(const struct file *filp);
+
+/* A directory entry as read by http_file_readdir(), which packs them one
+ * after another
+ */
+struct http_file_dirent {
+    unsigned short len;
+    bool dir;
+    char name[]; /* not NUL-terminated */
+};
+
+static inline size_t http_file_dirent_size(size_t len)
+{
+    return ALIGN(offsetof(struct http_file_dirent, name) + len,
+                 __alignof__(struct http_file_dirent));
+}
+
+extern int http_file_readdir(struct file *dir, char *buf, size_t size);
+#endif
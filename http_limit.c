@@ -0,0 +1,142 @@
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+
+#include "http_limit.h"
+
+#define DEFAULT_MAX_CONNS 16384
+#define CONN_TABLE_BITS 12
+#define RATE_TABLE_BITS 10
+
+static unsigned int max_conns = DEFAULT_MAX_CONNS;
+module_param(max_conns, uint, 0644);
+MODULE_PARM_DESC(max_conns, "max concurrent connections, 0 for no limit");
+
+static unsigned int max_conns_per_ip;
+module_param(max_conns_per_ip, uint, 0644);
+MODULE_PARM_DESC(max_conns_per_ip, "max concurrent connections per client");
+
+static unsigned int rate_limit;
+module_param(rate_limit, uint, 0644);
+MODULE_PARM_DESC(rate_limit, "requests per second per client and CPU");
+
+static unsigned int rate_burst;
+module_param(rate_burst, uint, 0644);
+MODULE_PARM_DESC(rate_burst, "requests a client may send at once");
+
+static atomic_t conns = ATOMIC_INIT(0);
+
+/* Connections per client address hash. Clients sharing a slot share the
+ * limit, which costs some precision but no allocation or locking.
+ */
+static atomic_t conn_table[1 << CONN_TABLE_BITS];
+
+/* A token bucket, in units of 1/HZ request. A client hashing to a slot
+ * owned by another one takes it over with a full bucket.
+ */
+struct http_rate_bucket {
+    u32 key;
+    u64 tokens;
+    unsigned long stamp;
+};
+
+struct http_rate_table {
+    struct http_rate_bucket buckets[1 << RATE_TABLE_BITS];
+};
+
+static struct http_rate_table __percpu *rate_tables;
+static u32 limit_seed;
+
+static u32 http_limit_hash(const struct sockaddr *peer)
+{
+    if (peer->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) peer;
+        return jhash_1word((__force u32) sin->sin_addr.s_addr, limit_seed);
+    }
+    if (peer->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) peer;
+        return jhash2((const u32 *) &sin6->sin6_addr, 4, limit_seed);
+    }
+    return limit_seed;
+}
+
+bool http_limit_conn_get(const struct sockaddr *peer)
+{
+    atomic_t *slot = &conn_table[hash_32(http_limit_hash(peer),
+                                         CONN_TABLE_BITS)];
+    unsigned int max = READ_ONCE(max_conns);
+    unsigned int max_per_ip = READ_ONCE(max_conns_per_ip);
+
+    /* count unconditionally so that limits can change at runtime */
+    if (atomic_inc_return(&conns) > max && max)
+        goto err_conns;
+    if (atomic_inc_return(slot) > max_per_ip && max_per_ip)
+        goto err_slot;
+    return true;
+
+err_slot:
+    atomic_dec(slot);
+err_conns:
+    atomic_dec(&conns);
+    return false;
+}
+
+void http_limit_conn_put(const struct sockaddr *peer)
+{
+    atomic_dec(&conn_table[hash_32(http_limit_hash(peer), CONN_TABLE_BITS)]);
+    atomic_dec(&conns);
+}
+
+/* Buckets are per CPU, so a client spreading its connections over CPUs
+ * gets up to rate_limit requests per second on each of them.
+ */
+bool http_limit_request(const struct sockaddr *peer)
+{
+    unsigned int rate = READ_ONCE(rate_limit);
+    unsigned int burst = READ_ONCE(rate_burst) ?: rate;
+    struct http_rate_bucket *bucket;
+    u64 max_tokens = (u64) burst * HZ;
+    u32 key;
+    bool ok;
+
+    if (!rate)
+        return true;
+
+    key = http_limit_hash(peer) | 1;
+    bucket = &get_cpu_ptr(rate_tables)
+                  ->buckets[hash_32(key, RATE_TABLE_BITS)];
+    if (bucket->key != key) {
+        bucket->key = key;
+        bucket->tokens = max_tokens;
+    } else {
+        bucket->tokens += (u64) (jiffies - bucket->stamp) * rate;
+        if (bucket->tokens > max_tokens)
+            bucket->tokens = max_tokens;
+    }
+    bucket->stamp = jiffies;
+    ok = bucket->tokens >= HZ;
+    if (ok)
+        bucket->tokens -= HZ;
+    put_cpu_ptr(rate_tables);
+    return ok;
+}
+
+int http_limit_init(void)
+{
+    rate_tables = alloc_percpu(struct http_rate_table);
+    if (!rate_tables)
+        return -ENOMEM;
+    limit_seed = get_random_u32();
+    return 0;
+}
+
+void http_limit_exit(void)
+{
+    free_percpu(rate_tables);
+}
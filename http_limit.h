@@ -0,0 +1,18 @@
+#ifndef KHTTPD_HTTP_LIMIT_H
+#define KHTTPD_HTTP_LIMIT_H
+
+#include <linux/socket.h>
+#include <linux/types.h>
+
+extern int http_limit_init(void);
+extern void http_limit_exit(void);
+
+/* Admit a new connection from @peer, false if a connection limit is hit.
+ * Every admitted connection must be released with http_limit_conn_put().
+ */
+extern bool http_limit_conn_get(const struct sockaddr *peer);
+extern void http_limit_conn_put(const struct sockaddr *peer);
+
+/* Take a token for one request from @peer, false if it is over its rate */
+extern bool http_limit_request(const struct sockaddr *peer);
+#endif
@@ -0,0 +1,344 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/errno.h>
+#include <linux/in.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/socket.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/tcp.h>
+#include <linux/version.h>
+#include <net/sock.h>
+#include <net/tcp_states.h>
+
+#include "http_proxy.h"
+#include "http_stats.h"
+
+#define DEFAULT_BACKEND_POOL 16
+#define DEFAULT_BACKEND_TIMEOUT 30
+#define CONNECTION_TOKENS_MAX 16
+
+static unsigned int backend_pool = DEFAULT_BACKEND_POOL;
+module_param(backend_pool, uint, 0644);
+MODULE_PARM_DESC(backend_pool, "idle backend connections kept open");
+
+static unsigned int backend_timeout = DEFAULT_BACKEND_TIMEOUT;
+module_param(backend_timeout, uint, 0644);
+MODULE_PARM_DESC(backend_timeout,
+                 "seconds to wait on the backend for each read or write");
+
+static struct sockaddr_storage backend_addr;
+static int backend_addrlen;
+
+/* Idle connections, the most recently used first: it is the likeliest to
+ * still be open on the backend's side
+ */
+static LIST_HEAD(upstream_pool);
+static unsigned int upstream_idle;
+static DEFINE_SPINLOCK(upstream_lock);
+
+/* Headers about the connection to the peer rather than the message, which
+ * a proxy never passes on (RFC 7230, section 6.1)
+ */
+static const char *const hop_by_hop[] = {
+    "Connection",          "Keep-Alive", "Proxy-Authenticate",
+    "Proxy-Authorization", "Proxy-Connection", "TE",
+    "Trailer",             "Transfer-Encoding", "Upgrade",
+    NULL,
+};
+
+void http_proxy_init(const struct sockaddr *addr, int len)
+{
+    memcpy(&backend_addr, addr, len);
+    backend_addrlen = len;
+}
+
+bool http_proxy_enabled(void)
+{
+    return backend_addrlen;
+}
+
+static void http_upstream_free(struct http_upstream *up)
+{
+    kernel_sock_shutdown(up->socket, SHUT_RDWR);
+    sock_release(up->socket);
+    kvfree(up->buf);
+    kfree(up);
+}
+
+void http_proxy_exit(void)
+{
+    struct http_upstream *up, *tmp;
+
+    list_for_each_entry_safe (up, tmp, &upstream_pool, node)
+        http_upstream_free(up);
+    INIT_LIST_HEAD(&upstream_pool);
+    upstream_idle = 0;
+}
+
+struct http_upstream *http_upstream_connect(void)
+{
+    int family = backend_addr.ss_family;
+    long timeout = READ_ONCE(backend_timeout) * HZ ?: MAX_SCHEDULE_TIMEOUT;
+    struct http_upstream *up;
+    int err;
+
+    up = kzalloc(sizeof(*up), GFP_KERNEL);
+    if (!up)
+        return ERR_PTR(-ENOMEM);
+    up->buf = kvmalloc(HTTP_UPSTREAM_BUF_SIZE, GFP_KERNEL);
+    if (!up->buf) {
+        kfree(up);
+        return ERR_PTR(-ENOMEM);
+    }
+    err = sock_create(family, SOCK_STREAM,
+                      family == AF_UNIX ? 0 : IPPROTO_TCP, &up->socket);
+    if (err < 0) {
+        kvfree(up->buf);
+        kfree(up);
+        return ERR_PTR(err);
+    }
+    /* blocking calls, connect included, give up after the timeout */
+    up->socket->sk->sk_rcvtimeo = timeout;
+    up->socket->sk->sk_sndtimeo = timeout;
+    if (family != AF_UNIX) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+        tcp_sock_set_nodelay(up->socket->sk);
+#else
+        int one = 1;
+        kernel_setsockopt(up->socket, SOL_TCP, TCP_NODELAY, (char *) &one,
+                          sizeof(one));
+#endif
+    }
+    err = kernel_connect(up->socket, (struct sockaddr *) &backend_addr,
+                         backend_addrlen, 0);
+    if (err < 0) {
+        pr_debug("backend connect failure, err=%d\n", err);
+        http_upstream_free(up);
+        return ERR_PTR(err == -EINPROGRESS ? -ETIMEDOUT : err);
+    }
+    http_stats_inc(HTTP_STAT_UPSTREAM_CONNECTS);
+    return up;
+}
+
+/* Whether an idle connection can still take a request: the backend has
+ * neither closed it nor sent anything unasked
+ */
+static bool http_upstream_alive(const struct http_upstream *up)
+{
+    struct sock *sk = up->socket->sk;
+
+    return READ_ONCE(sk->sk_state) == TCP_ESTABLISHED &&
+           !READ_ONCE(sk->sk_err) &&
+           !(READ_ONCE(sk->sk_shutdown) & RCV_SHUTDOWN) &&
+           skb_queue_empty_lockless(&sk->sk_receive_queue);
+}
+
+struct http_upstream *http_upstream_get(void)
+{
+    struct http_upstream *up;
+
+    for (;;) {
+        spin_lock(&upstream_lock);
+        up = list_first_entry_or_null(&upstream_pool, struct http_upstream,
+                                      node);
+        if (up) {
+            list_del(&up->node);
+            upstream_idle--;
+        }
+        spin_unlock(&upstream_lock);
+        if (!up)
+            return http_upstream_connect();
+        if (http_upstream_alive(up)) {
+            up->reused = true;
+            return up;
+        }
+        http_upstream_free(up);
+    }
+}
+
+void http_upstream_put(struct http_upstream *up, bool reuse)
+{
+    if (reuse) {
+        spin_lock(&upstream_lock);
+        if (upstream_idle < READ_ONCE(backend_pool)) {
+            list_add(&up->node, &upstream_pool);
+            upstream_idle++;
+            up = NULL;
+        }
+        spin_unlock(&upstream_lock);
+    }
+    if (up)
+        http_upstream_free(up);
+}
+
+int http_upstream_send(struct http_upstream *up,
+                       struct kvec *vec,
+                       size_t nr,
+                       size_t len)
+{
+    struct msghdr msg = {.msg_flags = MSG_NOSIGNAL};
+    int ret = kernel_sendmsg(up->socket, &msg, vec, nr, len);
+
+    if (ret == -EAGAIN)
+        return -ETIMEDOUT;
+    if (ret < 0)
+        return ret;
+    /* cut short by the timeout */
+    return ret == len ? 0 : -ETIMEDOUT;
+}
+
+int http_upstream_recv(struct http_upstream *up, char *buf, size_t size)
+{
+    struct kvec vec = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg = {.msg_flags = 0};
+    int ret = kernel_recvmsg(up->socket, &msg, &vec, 1, size, 0);
+
+    return ret == -EAGAIN ? -ETIMEDOUT : ret;
+}
+
+size_t http_proxy_head_len(const char *p, size_t len)
+{
+    const char *line = p, *end = p + len, *lf;
+
+    while ((lf = memchr(line, '\n', end - line))) {
+        if (lf == line || (lf == line + 1 && *line == '\r'))
+            return lf + 1 - p;
+        line = lf + 1;
+    }
+    return 0;
+}
+
+/* Whether the @len byte header name at @name is one of @names */
+static bool http_proxy_named(const char *name,
+                             size_t len,
+                             const char *const *names)
+{
+    for (; *names; names++) {
+        if (strlen(*names) == len && !strncasecmp(name, *names, len))
+            return true;
+    }
+    return false;
+}
+
+/* A header name listed by the Connection header */
+struct http_proxy_token {
+    const char *p;
+    size_t len;
+};
+
+/* Collect the tokens of the Connection headers among the @len bytes of
+ * header lines at @p into @tokens: the headers they name are hop-by-hop
+ * too (RFC 9110, section 7.6.1). Returns how many, or -EBADMSG if there
+ * are more than CONNECTION_TOKENS_MAX.
+ */
+static int http_proxy_connection_tokens(const char *p,
+                                        size_t len,
+                                        struct http_proxy_token *tokens)
+{
+    const char *end = p + len;
+    bool connection = false;
+    int nr = 0;
+
+    while (p < end) {
+        const char *lf = memchr(p, '\n', end - p);
+        const char *next = lf ? lf + 1 : end;
+        const char *eol = lf ? lf : end, *v = p;
+
+        if (eol > p && eol[-1] == '\r')
+            eol--;
+        if (eol == p)
+            break;
+        if (*p != ' ' && *p != '\t') {
+            const char *colon = memchr(p, ':', eol - p);
+
+            connection = colon && colon - p == 10 &&
+                         !strncasecmp(p, "Connection", 10);
+            v = colon ? colon + 1 : eol;
+        }
+        while (connection && v < eol) {
+            const char *token;
+
+            while (v < eol && (*v == ' ' || *v == '\t' || *v == ','))
+                v++;
+            token = v;
+            while (v < eol && *v != ' ' && *v != '\t' && *v != ',')
+                v++;
+            if (v == token)
+                break;
+            if (nr == CONNECTION_TOKENS_MAX)
+                return -EBADMSG;
+            tokens[nr].p = token;
+            tokens[nr].len = v - token;
+            nr++;
+        }
+        p = next;
+    }
+    return nr;
+}
+
+/* Whether the @len byte header name at @name is one of the @nr @tokens */
+static bool http_proxy_listed(const struct http_proxy_token *tokens,
+                              int nr,
+                              const char *name,
+                              size_t len)
+{
+    for (int i = 0; i < nr; i++) {
+        if (tokens[i].len == len && !strncasecmp(name, tokens[i].p, len))
+            return true;
+    }
+    return false;
+}
+
+int http_proxy_headers(const char *p,
+                       size_t len,
+                       const char *const *drop,
+                       int (*emit)(void *arg, const char *line, size_t len),
+                       void *arg)
+{
+    struct http_proxy_token tokens[CONNECTION_TOKENS_MAX];
+    int nr = http_proxy_connection_tokens(p, len, tokens);
+    const char *end = p + len;
+    bool skip = false;
+    int flags = 0;
+
+    if (nr < 0)
+        return nr;
+
+    while (p < end) {
+        const char *lf = memchr(p, '\n', end - p);
+        const char *next = lf ? lf + 1 : end;
+        size_t n = (lf ? lf : end) - p;
+
+        if (n && p[n - 1] == '\r')
+            n--;
+        if (!n)
+            break;
+        if (*p != ' ' && *p != '\t') {
+            const char *colon = memchr(p, ':', n);
+            size_t name = colon ? colon - p : n;
+
+            skip = http_proxy_named(p, name, hop_by_hop) ||
+                   (drop && http_proxy_named(p, name, drop)) ||
+                   http_proxy_listed(tokens, nr, p, name);
+            if (colon && name == 6 && !strncasecmp(p, "Expect", 6)) {
+                const char *v = colon + 1;
+
+                while (v < p + n && (*v == ' ' || *v == '\t'))
+                    v++;
+                if (p + n - v >= 12 && !strncasecmp(v, "100-continue", 12))
+                    flags |= HTTP_PROXY_CONTINUE;
+            }
+        }
+        if (!skip) {
+            int ret = emit(arg, p, n);
+            if (ret < 0)
+                return ret;
+        }
+        p = next;
+    }
+    return flags;
+}
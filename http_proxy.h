@@ -0,0 +1,68 @@
+#ifndef KHTTPD_HTTP_PROXY_H
+#define KHTTPD_HTTP_PROXY_H
+
+#include <linux/list.h>
+#include <linux/net.h>
+#include <linux/types.h>
+#include <linux/uio.h>
+
+/* Room for a response head from the backend */
+#define HTTP_UPSTREAM_BUF_SIZE (16 * 1024)
+
+/* A connection to the backend, pooled between requests */
+struct http_upstream {
+    struct socket *socket;
+    struct list_head node;
+    bool reused; /* taken from the pool rather than just connected */
+    char *buf;   /* HTTP_UPSTREAM_BUF_SIZE bytes to read responses into */
+};
+
+/* Set when the header lines handed to http_proxy_headers() had these */
+#define HTTP_PROXY_CONTINUE 0x1 /* Expect: 100-continue */
+
+/* Forward requests to the backend listening at the @len byte @addr */
+extern void http_proxy_init(const struct sockaddr *addr, int len);
+extern void http_proxy_exit(void);
+extern bool http_proxy_enabled(void);
+
+/* An idle pooled connection, or a new one */
+extern struct http_upstream *http_upstream_get(void);
+
+/* A new connection, whatever the pool holds */
+extern struct http_upstream *http_upstream_connect(void);
+
+/* Pool @up if @reuse is set and the pool has room, else close it */
+extern void http_upstream_put(struct http_upstream *up, bool reuse);
+
+/* Send all @len bytes of @vec. Returns 0 or a negative errno. */
+extern int http_upstream_send(struct http_upstream *up,
+                              struct kvec *vec,
+                              size_t nr,
+                              size_t len);
+
+/* Receive up to @size bytes. Returns how many, 0 at the end of the stream,
+ * -ETIMEDOUT if the backend took longer than backend_timeout, or another
+ * negative errno.
+ */
+extern int http_upstream_recv(struct http_upstream *up, char *buf, size_t size);
+
+/* The length of the head at @p, up to and including the empty line ending
+ * it, or 0 if the @len bytes do not hold all of it
+ */
+extern size_t http_proxy_head_len(const char *p, size_t len);
+
+/* Pass each line of the @len bytes of header lines at @p, without its line
+ * end, to @emit, except hop-by-hop headers, those the Connection header
+ * lists and those named in the NULL-terminated @drop. Folded lines go with
+ * the one they continue.
+ * Returns the first error @emit returned, -EBADMSG if Connection lists more
+ * than 16 headers, or HTTP_PROXY_* flags.
+ */
+extern int http_proxy_headers(const char *p,
+                              size_t len,
+                              const char *const *drop,
+                              int (*emit)(void *arg,
+                                          const char *line,
+                                          size_t len),
+                              void *arg);
+#endif
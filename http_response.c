@@ -0,0 +1,504 @@
+#include <linux/cache.h>
+#include <linux/ctype.h>
+#include <linux/errno.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/time.h>
+#include <linux/timekeeping.h>
+#include <linux/timer.h>
+#include <linux/version.h>
+
+#include "http_response.h"
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LEN 29
+#define HTTP_DATE_LINE_LEN (sizeof("Date: " CRLF) - 1 + HTTP_DATE_LEN)
+
+struct http_status_template {
+    const char *head;
+    unsigned short len;
+    unsigned short reason_len; /* of the "404 Not Found" CRLF within it */
+};
+
+#define HTTP_STATUS_TEMPLATE(line)                                    \
+    ((struct http_status_template){                                   \
+        "HTTP/1.1 " line "Server: " KBUILD_MODNAME CRLF,              \
+        sizeof("HTTP/1.1 " line "Server: " KBUILD_MODNAME CRLF) - 1, \
+        sizeof(line) - 1,                                             \
+    })
+
+/* Readers copy whichever line is current; the timer only writes the other
+ * one, so a copy is never torn even if the timer runs in between.
+ */
+struct http_date {
+    char line[2][HTTP_DATE_LINE_LEN];
+    unsigned int cur;
+};
+
+static DEFINE_PER_CPU_ALIGNED(struct http_date, http_dates);
+static struct timer_list http_date_timer;
+
+static const char http_digits[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char http_days[7][4] = {"Sun", "Mon", "Tue", "Wed",
+                                     "Thu", "Fri", "Sat"};
+static const char http_months[12][4] = {"Jan", "Feb", "Mar", "Apr",
+                                        "May", "Jun", "Jul", "Aug",
+                                        "Sep", "Oct", "Nov", "Dec"};
+
+static const struct {
+    const char *name;
+    size_t len;
+} http_encodings[NR_HTTP_ENCODINGS] = {
+    [HTTP_ENCODING_IDENTITY] = {"identity", 8},
+    [HTTP_ENCODING_GZIP] = {"gzip", 4},
+    [HTTP_ENCODING_DEFLATE] = {"deflate", 7},
+};
+
+static struct http_status_template http_status_template(
+    enum http_status status)
+{
+    switch (status) {
+#define XX(num, name, string) \
+    case HTTP_STATUS_##name:  \
+        return HTTP_STATUS_TEMPLATE(#num " " #string CRLF);
+        HTTP_STATUS_MAP(XX)
+#undef XX
+    default:
+        return HTTP_STATUS_TEMPLATE("500 Internal Server Error" CRLF);
+    }
+}
+
+char *http_put_status(char *p, enum http_status status)
+{
+    struct http_status_template t = http_status_template(status);
+    return http_put(p, t.head, t.len);
+}
+
+static char *http_put_2digits(char *p, unsigned int v)
+{
+    return http_put(p, &http_digits[v * 2], 2);
+}
+
+/* Two digits at a time from the end, then moved into place */
+char *http_put_u64(char *p, u64 v)
+{
+    char buf[20], *q = buf + sizeof(buf);
+
+    while (v >= 100) {
+        q -= 2;
+        memcpy(q, &http_digits[do_div(v, 100) * 2], 2);
+    }
+    if (v >= 10) {
+        q -= 2;
+        memcpy(q, &http_digits[v * 2], 2);
+    } else {
+        *--q = '0' + v;
+    }
+    return http_put(p, q, buf + sizeof(buf) - q);
+}
+
+char *http_put_head_end(char *p, bool keep_alive)
+{
+    const struct http_date *date = raw_cpu_ptr(&http_dates);
+    unsigned int cur = READ_ONCE(date->cur);
+
+    /* any CPU's copy does if we migrate; this one is just cache-hot */
+    smp_rmb();
+    p = http_put(p, date->line[cur], HTTP_DATE_LINE_LEN);
+    if (keep_alive)
+        return http_put_lit(p, "Connection: Keep-Alive" CRLF CRLF);
+    return http_put_lit(p, "Connection: Close" CRLF CRLF);
+}
+
+char *http_put_status_response(char *p,
+                               enum http_status status,
+                               bool keep_alive)
+{
+    struct http_status_template t = http_status_template(status);
+
+    p = http_put(p, t.head, t.len);
+    p = http_put_lit(p, "Content-Type: text/plain" CRLF "Content-Length: ");
+    p = http_put_u64(p, t.reason_len);
+    p = http_put_lit(p, CRLF);
+    p = http_put_head_end(p, keep_alive);
+    /* the body is the status line without its protocol version */
+    return http_put(p, t.head + sizeof("HTTP/1.1 ") - 1, t.reason_len);
+}
+
+char *http_put_x64(char *p, u64 v)
+{
+    char buf[16], *q = buf + sizeof(buf);
+
+    do {
+        *--q = hex_asc[v & 15];
+        v >>= 4;
+    } while (v);
+    return http_put(p, q, buf + sizeof(buf) - q);
+}
+
+/* An IMF-fixdate, the only HTTP-date format we send */
+static char *http_put_date(char *p, time64_t t)
+{
+    unsigned int year;
+    struct tm tm;
+
+    time64_to_tm(t, 0, &tm);
+    year = tm.tm_year + 1900;
+    p = http_put(p, http_days[tm.tm_wday], 3);
+    p = http_put_lit(p, ", ");
+    p = http_put_2digits(p, tm.tm_mday);
+    *p++ = ' ';
+    p = http_put(p, http_months[tm.tm_mon], 3);
+    *p++ = ' ';
+    p = http_put_2digits(p, year / 100 % 100);
+    p = http_put_2digits(p, year % 100);
+    *p++ = ' ';
+    p = http_put_2digits(p, tm.tm_hour);
+    *p++ = ':';
+    p = http_put_2digits(p, tm.tm_min);
+    *p++ = ':';
+    p = http_put_2digits(p, tm.tm_sec);
+    return http_put_lit(p, " GMT");
+}
+
+static int http_parse_2digits(const char *s)
+{
+    if (!isdigit(s[0]) || !isdigit(s[1]))
+        return -1;
+    return (s[0] - '0') * 10 + s[1] - '0';
+}
+
+/* Parse an IMF-fixdate. The obsolete RFC 850 and asctime() forms are not
+ * recognised, which only costs such clients a full response.
+ */
+static bool http_parse_date(const char *s, time64_t *t)
+{
+    int day, mon, century, year, hour, min, sec;
+
+    if (strlen(s) != HTTP_DATE_LEN || memcmp(s + 3, ", ", 2) ||
+        s[7] != ' ' || s[11] != ' ' || s[16] != ' ' || s[19] != ':' ||
+        s[22] != ':' || strcmp(s + 25, " GMT"))
+        return false;
+    for (mon = 0; mon < 12; mon++) {
+        if (!memcmp(s + 8, http_months[mon], 3))
+            break;
+    }
+    day = http_parse_2digits(s + 5);
+    century = http_parse_2digits(s + 12);
+    year = http_parse_2digits(s + 14);
+    hour = http_parse_2digits(s + 17);
+    min = http_parse_2digits(s + 20);
+    sec = http_parse_2digits(s + 23);
+    if (mon == 12 || day < 1 || century < 0 || year < 0 || hour < 0 ||
+        hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+        return false;
+    *t = mktime64(century * 100 + year, mon + 1, day, hour, min, sec);
+    return true;
+}
+
+void http_validator_init(struct http_validator *v, const struct inode *inode)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    struct timespec64 mtime = inode_get_mtime(inode);
+#else
+    struct timespec64 mtime = inode->i_mtime;
+#endif
+    char *p = v->etag;
+
+    v->mtime = mtime.tv_sec;
+    *p++ = '"';
+    p = http_put_x64(p, inode->i_ino);
+    *p++ = '-';
+    p = http_put_x64(p, mtime.tv_sec);
+    *p++ = '.';
+    p = http_put_x64(p, mtime.tv_nsec);
+    *p++ = '-';
+    p = http_put_x64(p, i_size_read(inode));
+    *p++ = '"';
+    v->etag_len = p - v->etag;
+}
+
+void http_validator_encode(struct http_validator *v,
+                           enum http_encoding encoding)
+{
+    char *p = v->etag + v->etag_len - 1;
+
+    if (encoding == HTTP_ENCODING_IDENTITY)
+        return;
+    /* before the closing quote */
+    *p++ = '-';
+    p = http_put(p, http_encodings[encoding].name,
+                 http_encodings[encoding].len);
+    *p++ = '"';
+    v->etag_len = p - v->etag;
+}
+
+char *http_put_validators(char *p, const struct http_validator *v)
+{
+    p = http_put_lit(p, "ETag: ");
+    p = http_put(p, v->etag, v->etag_len);
+    p = http_put_lit(p, CRLF "Last-Modified: ");
+    p = http_put_date(p, v->mtime);
+    return http_put_lit(p, CRLF);
+}
+
+char *http_put_content_range(char *p,
+                             const struct http_range *range,
+                             loff_t size)
+{
+    p = http_put_lit(p, "Content-Range: bytes ");
+    if (range) {
+        p = http_put_u64(p, range->start);
+        *p++ = '-';
+        p = http_put_u64(p, range->start + range->len - 1);
+    } else {
+        *p++ = '*';
+    }
+    *p++ = '/';
+    p = http_put_u64(p, size);
+    return http_put_lit(p, CRLF);
+}
+
+/* Digits at @*s as a number, saturating; false if there are none */
+static bool http_parse_u64(const char **s, u64 *v)
+{
+    const char *p = *s;
+    u64 n = 0;
+
+    if (!isdigit(*p))
+        return false;
+    for (; isdigit(*p); p++)
+        n = n > (U64_MAX - 9) / 10 ? U64_MAX : n * 10 + *p - '0';
+    *s = p;
+    *v = n;
+    return true;
+}
+
+int http_parse_ranges(const char *s,
+                      loff_t size,
+                      struct http_range *ranges,
+                      int max)
+{
+    int nr = 0;
+
+    if (strncasecmp(s, "bytes=", 6))
+        return -EINVAL;
+    s += 6;
+    for (;;) {
+        u64 first, last;
+
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (*s == '-') {
+            /* the last bytes of the body */
+            s++;
+            if (!http_parse_u64(&s, &last))
+                return -EINVAL;
+            first = last < size ? size - last : 0;
+            last = last ? size - 1 : 0;
+            if (!size || first > last)
+                goto next;
+        } else {
+            if (!http_parse_u64(&s, &first) || *s++ != '-')
+                return -EINVAL;
+            if (!http_parse_u64(&s, &last))
+                last = U64_MAX;
+            else if (last < first)
+                return -EINVAL;
+            if (first >= size)
+                goto next;
+            last = min_t(u64, last, size - 1);
+        }
+        if (nr == max)
+            return -EINVAL;
+        ranges[nr].start = first;
+        ranges[nr].len = last - first + 1;
+        nr++;
+    next:
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (!*s)
+            return nr;
+        if (*s++ != ',')
+            return -EINVAL;
+    }
+}
+
+/* A q-value in thousandths, or -1 if malformed */
+static int http_parse_qvalue(const char *p, const char *end)
+{
+    int q, scale = 100;
+
+    if (p == end || (*p != '0' && *p != '1'))
+        return -1;
+    q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        for (p++; p < end && isdigit(*p) && scale; p++, scale /= 10)
+            q += (*p - '0') * scale;
+    }
+    return p == end && q <= 1000 ? q : -1;
+}
+
+enum http_encoding http_accept_encoding(const char *s)
+{
+    int q[NR_HTTP_ENCODINGS], any = -1;
+    enum http_encoding best = HTTP_ENCODING_IDENTITY;
+
+    for (int i = 0; i < NR_HTTP_ENCODINGS; i++)
+        q[i] = -1;
+    while (*s) {
+        const char *name, *end, *param;
+        size_t len;
+        int value = 1000;
+
+        while (*s == ' ' || *s == '\t' || *s == ',')
+            s++;
+        name = s;
+        while (*s && *s != ',')
+            s++;
+        end = s;
+        while (end > name && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        param = memchr(name, ';', end - name);
+        len = (param ? param : end) - name;
+        while (len && (name[len - 1] == ' ' || name[len - 1] == '\t'))
+            len--;
+        if (param) {
+            for (param++; *param == ' ' || *param == '\t'; param++)
+                ;
+            if (strncasecmp(param, "q=", 2))
+                continue;
+            value = http_parse_qvalue(param + 2, end);
+            if (value < 0)
+                continue;
+        }
+
+        if (len == 1 && *name == '*') {
+            any = value;
+            continue;
+        }
+        for (int i = HTTP_ENCODING_GZIP; i < NR_HTTP_ENCODINGS; i++) {
+            if (len == http_encodings[i].len &&
+                !strncasecmp(name, http_encodings[i].name, len))
+                q[i] = value;
+        }
+        if (len == 6 && !strncasecmp(name, "x-gzip", 6))
+            q[HTTP_ENCODING_GZIP] = value;
+    }
+
+    /* "*" stands for the codings not listed; ties go to the earlier one */
+    for (int i = HTTP_ENCODING_GZIP; i < NR_HTTP_ENCODINGS; i++) {
+        int value = q[i] < 0 ? any : q[i];
+
+        if (value > 0 && (best == HTTP_ENCODING_IDENTITY || value > q[best]))
+            best = i;
+        q[i] = value;
+    }
+    return best;
+}
+
+char *http_put_content_encoding(char *p, enum http_encoding encoding)
+{
+    if (encoding == HTTP_ENCODING_IDENTITY)
+        return p;
+    p = http_put_lit(p, "Content-Encoding: ");
+    p = http_put(p, http_encodings[encoding].name,
+                 http_encodings[encoding].len);
+    return http_put_lit(p, CRLF);
+}
+
+bool http_if_range(const struct http_validator *v, const char *if_range)
+{
+    time64_t t;
+
+    if (!*if_range)
+        return true;
+    /* strong comparison, so a weak ETag never matches */
+    if (*if_range == '"')
+        return strlen(if_range) == v->etag_len &&
+               !memcmp(if_range, v->etag, v->etag_len);
+    return http_parse_date(if_range, &t) && t == v->mtime;
+}
+
+/* Weak comparison of @v's ETag against an If-None-Match list */
+static bool http_etag_match(const struct http_validator *v, const char *p)
+{
+    for (;;) {
+        const char *end;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '*')
+            return true;
+        if (!strncmp(p, "W/", 2))
+            p += 2;
+        if (*p != '"')
+            return false;
+        end = strchr(p + 1, '"');
+        if (!end)
+            return false;
+        end++;
+        if (end - p == v->etag_len && !memcmp(p, v->etag, v->etag_len))
+            return true;
+        p = end;
+    }
+}
+
+bool http_not_modified(const struct http_validator *v,
+                       const char *if_none_match,
+                       const char *if_modified_since)
+{
+    time64_t since;
+
+    /* If-Modified-Since only counts without If-None-Match */
+    if (*if_none_match)
+        return http_etag_match(v, if_none_match);
+    return *if_modified_since &&
+           http_parse_date(if_modified_since, &since) && v->mtime <= since;
+}
+
+/* Render the Date header once per second into every CPU's copy */
+static void http_date_update(struct timer_list *timer)
+{
+    char line[HTTP_DATE_LINE_LEN];
+    struct timespec64 now;
+    int cpu;
+
+    ktime_get_real_ts64(&now);
+    http_put_lit(http_put_date(http_put_lit(line, "Date: "), now.tv_sec),
+                 CRLF);
+    for_each_possible_cpu (cpu) {
+        struct http_date *date = per_cpu_ptr(&http_dates, cpu);
+        unsigned int next = !date->cur;
+
+        memcpy(date->line[next], line, HTTP_DATE_LINE_LEN);
+        smp_wmb();
+        WRITE_ONCE(date->cur, next);
+    }
+    /* just past the next second */
+    mod_timer(timer,
+              jiffies + nsecs_to_jiffies(NSEC_PER_SEC - now.tv_nsec) + 1);
+}
+
+void http_response_init(void)
+{
+    timer_setup(&http_date_timer, http_date_update, 0);
+    http_date_update(&http_date_timer);
+}
+
+void http_response_exit(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    timer_delete_sync(&http_date_timer);
+#else
+    del_timer_sync(&http_date_timer);
+#endif
+}
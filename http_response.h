@@ -0,0 +1,130 @@
+#ifndef KHTTPD_HTTP_RESPONSE_H
+#define KHTTPD_HTTP_RESPONSE_H
+
+#include <linux/fs.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#include "http_parser.h"
+
+#define CRLF "\r\n"
+
+/* Bytes written by http_put_head_end() at most */
+#define HTTP_HEAD_END_MAX 64
+
+/* Bytes written by http_put_status_response() at most */
+#define HTTP_STATUS_RESPONSE_MAX 256
+
+/* Quoted ETag of at most four 64-bit numbers in hex and their separators,
+ * followed by the name of a content coding
+ */
+#define HTTP_ETAG_MAX 80
+
+/* Bytes written by http_put_validators() at most */
+#define HTTP_VALIDATORS_MAX (HTTP_ETAG_MAX + 64)
+
+/* Content codings, in order of preference */
+enum http_encoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE,
+    NR_HTTP_ENCODINGS,
+};
+
+/* Ranges honoured in one request; with more the whole body is sent */
+#define HTTP_RANGES_MAX 8
+
+/* Bytes written by http_put_content_range() at most */
+#define HTTP_CONTENT_RANGE_MAX 96
+
+/* A satisfiable byte range of a body */
+struct http_range {
+    loff_t start;
+    loff_t len;
+};
+
+/* What conditional requests are checked against */
+struct http_validator {
+    time64_t mtime;
+    unsigned int etag_len;
+    char etag[HTTP_ETAG_MAX];
+};
+
+/* Response heads are written front to back; each http_put_*() writes at @p
+ * and returns the end of what it wrote. The caller provides the room.
+ */
+static inline char *http_put(char *p, const void *s, size_t len)
+{
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* Copy a string literal, whose length is known at build time */
+#define http_put_lit(p, s) http_put(p, s, sizeof(s) - 1)
+
+extern void http_response_init(void);
+extern void http_response_exit(void);
+
+/* The status line and Server header */
+extern char *http_put_status(char *p, enum http_status status);
+
+/* Date and Connection headers and the empty line ending the head */
+extern char *http_put_head_end(char *p, bool keep_alive);
+
+extern char *http_put_u64(char *p, u64 v);
+extern char *http_put_x64(char *p, u64 v);
+
+/* Content-Range header for @range of a @size byte body, or for none of it
+ * if @range is NULL
+ */
+extern char *http_put_content_range(char *p,
+                                    const struct http_range *range,
+                                    loff_t size);
+
+/* Parse a Range header against a @size byte body into at most @max ranges.
+ * Returns how many are satisfiable, possibly 0, or -EINVAL if the header
+ * is to be ignored: malformed, in other units, or asking for too much.
+ */
+extern int http_parse_ranges(const char *s,
+                             loff_t size,
+                             struct http_range *ranges,
+                             int max);
+
+/* A strong ETag from the inode number, mtime and size, which change
+ * whenever the file is replaced or written to
+ */
+extern void http_validator_init(struct http_validator *v,
+                                const struct inode *inode);
+
+/* Make @v name the representation in @encoding; a strong ETag must differ
+ * between the encodings of a resource
+ */
+extern void http_validator_encode(struct http_validator *v,
+                                  enum http_encoding encoding);
+
+/* ETag and Last-Modified headers */
+extern char *http_put_validators(char *p, const struct http_validator *v);
+
+/* Whether a GET or HEAD with these If-None-Match and If-Modified-Since
+ * values, "" for an absent header, is answered with 304
+ */
+extern bool http_not_modified(const struct http_validator *v,
+                              const char *if_none_match,
+                              const char *if_modified_since);
+
+/* The coding preferred by an Accept-Encoding value, identity for "" */
+extern enum http_encoding http_accept_encoding(const char *s);
+
+/* Content-Encoding header, nothing for identity */
+extern char *http_put_content_encoding(char *p, enum http_encoding encoding);
+
+/* Whether a Range request may be served given its If-Range value, "" for
+ * an absent header
+ */
+extern bool http_if_range(const struct http_validator *v, const char *if_range);
+
+/* A whole response for @status, with the status as a text/plain body */
+extern char *http_put_status_response(char *p,
+                                      enum http_status status,
+                                      bool keep_alive);
+#endif
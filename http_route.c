@@ -0,0 +1,265 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/srcu.h>
+#include <linux/string.h>
+
+#include "http_route.h"
+#include "http_stats.h"
+
+/* Bounds the depth of the trie, which is walked recursively when built */
+#define ROUTE_PREFIX_MAX 64
+
+/* A node of the radix trie. @label is the edge from its parent, at least a
+ * byte long below the root. The routes whose prefix ends here come first
+ * in @routes; the children follow, the first bytes of their labels all
+ * different.
+ */
+struct http_route_node {
+    const char *label;
+    size_t label_len;
+    unsigned int nr_routes;
+    unsigned int nr_children;
+    struct http_route_node **children;
+    struct khttpd_route *routes[];
+};
+
+/* The trie is never changed in place: every registration builds a new one
+ * from route_list under route_mutex and swaps it in, and the old one is
+ * freed once no dispatch can still see it. Handlers run on the read side
+ * and sleep, hence SRCU.
+ */
+static struct http_route_node __rcu *route_root;
+static LIST_HEAD(route_list);
+static unsigned int route_count;
+static DEFINE_MUTEX(route_mutex);
+DEFINE_STATIC_SRCU(route_srcu);
+
+static int http_route_cmp(const void *a, const void *b)
+{
+    const struct khttpd_route *x = *(const struct khttpd_route **) a;
+    const struct khttpd_route *y = *(const struct khttpd_route **) b;
+
+    return strcmp(x->prefix, y->prefix);
+}
+
+static void http_route_free(struct http_route_node *node)
+{
+    if (!node)
+        return;
+    for (unsigned int i = 0; i < node->nr_children; i++)
+        http_route_free(node->children[i]);
+    kfree(node);
+}
+
+/* Build the trie for @nr routes sorted by prefix, which all share their
+ * first @depth bytes
+ */
+static struct http_route_node *http_route_build(struct khttpd_route **routes,
+                                                unsigned int nr,
+                                                size_t depth,
+                                                gfp_t gfp)
+{
+    const char *first = routes[0]->prefix + depth;
+    const char *last = routes[nr - 1]->prefix + depth;
+    unsigned int own = 0, nr_children = 0, i, j;
+    struct http_route_node *node;
+    size_t len = 0;
+
+    /* sorted, so what the first and the last share, all of them do */
+    while (first[len] && first[len] == last[len])
+        len++;
+    depth += len;
+    while (own < nr && !routes[own]->prefix[depth])
+        own++;
+    for (i = own; i < nr; i++) {
+        if (i == own ||
+            routes[i]->prefix[depth] != routes[i - 1]->prefix[depth])
+            nr_children++;
+    }
+
+    node = kmalloc(struct_size(node, routes, own + nr_children), gfp);
+    if (!node)
+        return NULL;
+    node->label = first;
+    node->label_len = len;
+    node->nr_routes = own;
+    node->nr_children = 0;
+    node->children = (struct http_route_node **) &node->routes[own];
+    memcpy(node->routes, routes, own * sizeof(*routes));
+    for (i = own; i < nr; i = j) {
+        struct http_route_node *child;
+
+        for (j = i + 1; j < nr; j++) {
+            if (routes[j]->prefix[depth] != routes[i]->prefix[depth])
+                break;
+        }
+        child = http_route_build(routes + i, j - i, depth, gfp);
+        if (!child) {
+            http_route_free(node);
+            return NULL;
+        }
+        node->children[node->nr_children++] = child;
+    }
+    return node;
+}
+
+/* Build the trie for route_list and swap it in; route_mutex held */
+static int http_route_publish(gfp_t gfp)
+{
+    struct http_route_node *root = NULL, *old;
+    struct khttpd_route **routes, *route;
+    unsigned int i = 0;
+
+    if (route_count) {
+        routes = kmalloc_array(route_count, sizeof(*routes), gfp);
+        if (!routes)
+            return -ENOMEM;
+        list_for_each_entry (route, &route_list, node)
+            routes[i++] = route;
+        sort(routes, route_count, sizeof(*routes), http_route_cmp, NULL);
+        root = http_route_build(routes, route_count, 0, gfp);
+        kfree(routes);
+        if (!root)
+            return -ENOMEM;
+    }
+    old = rcu_dereference_protected(route_root,
+                                    lockdep_is_held(&route_mutex));
+    rcu_assign_pointer(route_root, root);
+    synchronize_srcu(&route_srcu);
+    http_route_free(old);
+    return 0;
+}
+
+int khttpd_route_register(struct khttpd_route *route)
+{
+    struct khttpd_route *other;
+    int err = 0;
+
+    if (!route->handler || !route->prefix || route->prefix[0] != '/')
+        return -EINVAL;
+    if (strlen(route->prefix) > ROUTE_PREFIX_MAX)
+        return -ENAMETOOLONG;
+
+    mutex_lock(&route_mutex);
+    list_for_each_entry (other, &route_list, node) {
+        if (!strcmp(other->prefix, route->prefix) &&
+            (!other->methods || !route->methods ||
+             (other->methods & route->methods))) {
+            err = -EEXIST;
+            goto out;
+        }
+    }
+    list_add_tail(&route->node, &route_list);
+    route_count++;
+    err = http_route_publish(GFP_KERNEL);
+    if (err < 0) {
+        list_del(&route->node);
+        route_count--;
+    }
+out:
+    mutex_unlock(&route_mutex);
+    return err;
+}
+EXPORT_SYMBOL(khttpd_route_register);
+
+void khttpd_route_unregister(struct khttpd_route *route)
+{
+    mutex_lock(&route_mutex);
+    list_del(&route->node);
+    route_count--;
+    /* the old trie still points at @route, so this must not fail */
+    http_route_publish(GFP_KERNEL | __GFP_NOFAIL);
+    mutex_unlock(&route_mutex);
+}
+EXPORT_SYMBOL(khttpd_route_unregister);
+
+/* The route with the longest prefix matching the @len byte @path that
+ * takes @method
+ */
+static struct khttpd_route *http_route_lookup(
+    const struct http_route_node *node,
+    enum http_method method,
+    const char *path,
+    size_t len)
+{
+    struct khttpd_route *found = NULL;
+    size_t pos = 0;
+
+    while (node) {
+        const struct http_route_node *next = NULL;
+        unsigned int i;
+
+        if (len - pos < node->label_len ||
+            memcmp(path + pos, node->label, node->label_len))
+            break;
+        pos += node->label_len;
+        /* prefixes only match up to a segment boundary */
+        if (pos == len || path[pos] == '/' || (pos && path[pos - 1] == '/')) {
+            for (i = 0; i < node->nr_routes; i++) {
+                u64 methods = node->routes[i]->methods;
+                if (!methods || (methods & KHTTPD_METHOD(method))) {
+                    found = node->routes[i];
+                    break;
+                }
+            }
+        }
+        if (pos == len)
+            break;
+        for (i = 0; i < node->nr_children; i++) {
+            if (node->children[i]->label[0] == path[pos]) {
+                next = node->children[i];
+                break;
+            }
+        }
+        node = next;
+    }
+    return found;
+}
+
+int http_route_dispatch(struct http_request *request,
+                        enum http_method method,
+                        const char *path,
+                        size_t len)
+{
+    struct khttpd_route *route;
+    int idx, ret = 1;
+
+    /* without routes, requests never touch the SRCU counters */
+    if (!rcu_access_pointer(route_root))
+        return 1;
+    idx = srcu_read_lock(&route_srcu);
+    route = http_route_lookup(srcu_dereference(route_root, &route_srcu),
+                              method, path, len);
+    if (route) {
+        http_stats_inc(HTTP_STAT_ROUTED);
+        ret = min(route->handler(request, route->data), 0);
+    }
+    srcu_read_unlock(&route_srcu, idx);
+    return ret;
+}
+
+bool http_route_match(enum http_method method, const char *path, size_t len)
+{
+    bool found;
+    int idx;
+
+    if (!rcu_access_pointer(route_root))
+        return false;
+    idx = srcu_read_lock(&route_srcu);
+    found = http_route_lookup(srcu_dereference(route_root, &route_srcu),
+                              method, path, len);
+    srcu_read_unlock(&route_srcu, idx);
+    return found;
+}
+
+/* Modules registering routes depend on this one, so none are left */
+void http_route_exit(void)
+{
+    http_route_free(rcu_dereference_protected(route_root, 1));
+    RCU_INIT_POINTER(route_root, NULL);
+}
@@ -0,0 +1,20 @@
+#ifndef KHTTPD_HTTP_ROUTE_H
+#define KHTTPD_HTTP_ROUTE_H
+
+#include "khttpd.h"
+
+extern void http_route_exit(void);
+
+/* Hand @request, for the @len byte @path, to the route it matches. Returns
+ * what the handler did, or 1 if no route takes it.
+ */
+extern int http_route_dispatch(struct http_request *request,
+                               enum http_method method,
+                               const char *path,
+                               size_t len);
+
+/* Whether a route takes @method for the @len byte @path */
+extern bool http_route_match(enum http_method method,
+                             const char *path,
+                             size_t len);
+#endif
@@ -1,110 +1,2050 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/ctype.h>
+#include <linux/kref.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mempool.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/random.h>
 #include <linux/sched/signal.h>
+#include <linux/slab.h>
 #include <linux/tcp.h>
+#include <linux/timer.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/wait.h>
 
+#include "access_log.h"
+#include "http_cache.h"
+#include "http_compress.h"
+#include "http_fastparse.h"
+#include "http_file.h"
+#include "http_limit.h"
 #include "http_parser.h"
+#include "http_proxy.h"
+#include "http_response.h"
+#include "http_route.h"
 #include "http_server.h"
+#include "http_stats.h"
 
-#define CRLF "\r\n"
-
-#define HTTP_RESPONSE_200_DUMMY                               \
-    ""                                                        \
-    "HTTP/1.1 200 OK" CRLF "Server: " KBUILD_MODNAME CRLF     \
-    "Content-Type: text/plain" CRLF "Content-Length: 12" CRLF \
-    "Connection: Close" CRLF CRLF "Hello World!" CRLF
-#define HTTP_RESPONSE_200_KEEPALIVE_DUMMY                     \
-    ""                                                        \
-    "HTTP/1.1 200 OK" CRLF "Server: " KBUILD_MODNAME CRLF     \
-    "Content-Type: text/plain" CRLF "Content-Length: 12" CRLF \
-    "Connection: Keep-Alive" CRLF CRLF "Hello World!" CRLF
-#define HTTP_RESPONSE_501                                              \
-    ""                                                                 \
-    "HTTP/1.1 501 Not Implemented" CRLF "Server: " KBUILD_MODNAME CRLF \
-    "Content-Type: text/plain" CRLF "Content-Length: 21" CRLF          \
-    "Connection: Close" CRLF CRLF "501 Not Implemented" CRLF
-#define HTTP_RESPONSE_501_KEEPALIVE                                    \
-    ""                                                                 \
-    "HTTP/1.1 501 Not Implemented" CRLF "Server: " KBUILD_MODNAME CRLF \
-    "Content-Type: text/plain" CRLF "Content-Length: 21" CRLF          \
-    "Connection: KeepAlive" CRLF CRLF "501 Not Implemented" CRLF
+#define CREATE_TRACE_POINTS
+#include "http_trace.h"
 
+#define SEND_TIMEOUT (30 * HZ)
+#define DEFAULT_ZEROCOPY_MIN (16 * 1024)
+#define RESPONSE_HEADER_MAX 512
+#define BATCH_VECS 16
+#define POOL_MIN_NR 4
+#define DEFAULT_MAX_HEADER_SIZE (32 * 1024)
+#define SHED_LINGER_MAX 1024 /* refused connections lingering */
+#define SHED_LINGER_TIME HZ /* how long each may linger */
+#define SHED_LINGER_POLL (HZ / 10) /* how often its input is drained */
+#define BOUNDARY_LEN 16
+#define CHUNK_HEAD_LEN 6 /* "%04x" CRLF, wide enough for the whole scratch */
+#define CHUNK_FRAME_LEN (CHUNK_HEAD_LEN + 2)
+#define STREAM_CHUNK_MIN 1024
+#define PROXY_HEAD_EXTRA 192 /* request line and headers khttpd adds */
 
+#define HTTP_RESPONSE_503                                                  \
+    ""                                                                     \
+    "HTTP/1.1 503 Service Unavailable" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 25" CRLF              \
+    "Retry-After: 1" CRLF "Connection: Close" CRLF CRLF                    \
+    "503 Service Unavailable" CRLF
+
+#define HTTP_RESPONSE_100 "HTTP/1.1 100 Continue" CRLF CRLF
+
+
+struct http_conn;
+
+/* The other request tokens follow the known headers */
+enum {
+    HTTP_SLICE_URL = NR_HTTP_HEADERS,
+    HTTP_SLICE_QUERY, /* the part of the URL past '?' */
+    HTTP_SLICE_FIELD, /* name of the header being parsed */
+    NR_HTTP_SLICES,
+};
+
+/* A response body of unknown length. Data is framed in place as chunks in
+ * the batch scratch, each taking what is left of it, so the body leaves in
+ * large sends with the rest of the batch and never needs more memory than
+ * the scratch. HTTP/1.0 clients get it unframed, ended by closing.
+ */
+struct http_stream {
+    struct http_conn *conn;
+    char *chunk; /* the open chunk's frame in the scratch, or NULL */
+    size_t len;  /* data bytes written into it */
+    size_t room; /* and how many it can take */
+    bool chunked;
+    bool discard; /* answering HEAD, no body is sent */
+};
+
+/* A request forwarded to the backend. The head goes out once parsed and a
+ * body follows as it arrives; the response is relayed once the request is
+ * complete.
+ */
+struct http_proxy {
+    struct http_upstream *upstream;
+    char *head; /* the head as sent, kept for a retry */
+    size_t head_len;
+    char *url; /* copied out of the input buffer, which moves on */
+    bool active;
+    bool chunked; /* the body is passed on as chunks */
+    bool body;    /* some of it has been sent */
+    int error;    /* forwarding failed, to be answered with 502 or 504 */
+};
+
+/* Request tokens point into the connection's input buffer, which keeps an
+ * unfinished request whole across reads. From http_request_headers() on
+ * every token is NUL-terminated in place.
+ */
 struct http_request {
-    struct socket *socket;
+    struct http_conn *conn;
     enum http_method method;
-    char request_url[128];
+    struct http_slice slices[NR_HTTP_SLICES];
+    char ends[NR_HTTP_SLICES]; /* the delimiters the NULs replaced */
+    int header; /* known header whose value is being parsed, or -1 */
+    bool in_header_value;
+    bool http11; /* the client takes chunked bodies */
+    bool keep_alive;
+    int status;
+    u64 start;        /* ktime_get_ns() at the first byte of the request */
+    u64 parsed;       /* ktime_get_ns() once the headers were parsed */
+    u64 output_before; /* http_conn_output() when the request began */
+    unsigned long begin; /* jiffies at the first byte of the request */
     int complete;
+    struct http_stream stream; /* for route handlers streaming a body */
+    struct http_proxy proxy;
+};
+
+/* Responses produced from one recv batch, sent with one kernel_sendmsg().
+ * Each vector refers to static data, to a held cache entry or to @scratch,
+ * so everything stays valid until http_batch_flush().
+ */
+struct http_batch {
+    struct kvec vec[BATCH_VECS];
+    struct http_cache_entry *entries[BATCH_VECS];
+    size_t nr_vec;
+    size_t nr_entries;
+    size_t queued; /* bytes in vec */
+    char *scratch; /* RECV_BUFFER_SIZE bytes for generated headers */
+    size_t scratch_used;
 };
 
-static int http_server_recv(struct socket *sock, char *buf, size_t size)
+/* A response body, held by a cache entry or read from a file */
+struct http_body {
+    struct http_cache_entry *entry;
+    struct file *filp;
+    bool zerocopy; /* send the file's pages rather than copies */
+    loff_t size;
+    const char *mime;
+    const struct http_validator *validator;
+    enum http_encoding encoding;
+    bool vary; /* other Accept-Encoding values get other representations */
+    bool index; /* @filp is the INDEX_FILE of the directory the URL names */
+};
+
+/* One accepted connection. Socket callbacks queue @work whenever the socket
+ * becomes readable or changes state, so an idle connection costs only this
+ * structure and never holds a worker.
+ */
+struct http_conn {
+    struct socket *socket;
+    struct work_struct work;
+    struct list_head node;
+    struct kref ref;
+    wait_queue_head_t wait; /* senders waiting for socket buffer space */
+    struct timer_list timer;
+    unsigned long deadline; /* jiffies, 0 when no timeout applies */
+    bool closed;
+    u64 id;       /* identifies the connection in tracepoints */
+    u64 requests; /* requests answered on this connection */
+    u64 sent;     /* response bytes sent on this connection */
+    struct sockaddr_in6 peer; /* large enough for IPv4 peers too */
+    struct http_batch *batch; /* set while the worker runs */
+    char *in;       /* input buffer, NULL while no request is pending */
+    size_t in_size;
+    size_t in_len;  /* bytes received into @in */
+    struct http_parser parser;
+    struct http_request request;
+    void (*saved_data_ready)(struct sock *sk);
+    void (*saved_write_space)(struct sock *sk);
+    void (*saved_state_change)(struct sock *sk);
+};
+
+/* Connections and receive buffers come from their own slab caches, whose
+ * per-CPU freelists keep a churning CPU off the shared allocator. Buffers
+ * are not zeroed: only the bytes received into them are ever read. The
+ * pool only guarantees forward progress when the slab runs dry.
+ */
+static struct kmem_cache *http_conn_cache;
+static struct kmem_cache *http_buf_cache;
+static mempool_t *http_buf_pool;
+
+/* Live connections, so that module unload can close them */
+static LIST_HEAD(conn_list);
+static DEFINE_MUTEX(conn_lock);
+static atomic64_t conn_ids = ATOMIC64_INIT(0);
+
+/* Smaller files are copied, which is cheaper than pinning their pages */
+static unsigned int zerocopy_min = DEFAULT_ZEROCOPY_MIN;
+module_param(zerocopy_min, uint, 0644);
+MODULE_PARM_DESC(zerocopy_min, "smallest file sent straight from page cache");
+
+static bool fast_parse = true;
+module_param(fast_parse, bool, 0644);
+MODULE_PARM_DESC(fast_parse, "parse plain GET and HEAD heads in a single pass");
+
+/* Requests are read into one RECV_BUFFER_SIZE buffer, grown for larger ones */
+static unsigned int max_header_size = DEFAULT_MAX_HEADER_SIZE;
+module_param(max_header_size, uint, 0644);
+MODULE_PARM_DESC(max_header_size, "largest request head accepted, in bytes");
+
+/* Limits on each phase of a connection, in seconds; 0 disables one */
+static unsigned int idle_timeout = 15;
+module_param(idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout, "seconds a connection may wait for a request");
+
+static unsigned int header_timeout = 10;
+module_param(header_timeout, uint, 0644);
+MODULE_PARM_DESC(header_timeout, "seconds to receive the request headers");
+
+static unsigned int request_timeout = 60;
+module_param(request_timeout, uint, 0644);
+MODULE_PARM_DESC(request_timeout, "seconds to receive and answer a request");
+
+/* Rearming the timer only ever pulls it in. A deadline that moved out is
+ * noticed by http_conn_timeout(), which then pushes the timer back, so a
+ * busy keep-alive connection rarely touches the timer wheel at all.
+ */
+static void http_conn_set_deadline(struct http_conn *conn,
+                                   unsigned long start,
+                                   unsigned int timeout)
+{
+    unsigned long deadline = 0;
+
+    if (timeout)
+        deadline = (start + (unsigned long) timeout * HZ) ?: 1;
+    WRITE_ONCE(conn->deadline, deadline);
+    if (deadline)
+        timer_reduce(&conn->timer, deadline);
+}
+
+static bool http_conn_expired(const struct http_conn *conn)
+{
+    unsigned long deadline = READ_ONCE(conn->deadline);
+    return deadline && time_after_eq(jiffies, deadline);
+}
+
+/* Called from the CPU about to use the buffer, so the slab hands out memory
+ * from its own node.
+ */
+static char *http_buf_get(void)
+{
+    http_stats_inc(HTTP_STAT_BUF_ALLOCS);
+    return mempool_alloc(http_buf_pool, GFP_KERNEL);
+}
+
+static void http_buf_put(char *buf)
+{
+    mempool_free(buf, http_buf_pool);
+}
+
+static int http_server_recv(struct socket *sock, char *buf, size_t size)
+{
+    struct kvec iov = {.iov_base = (void *) buf, .iov_len = size};
+    struct msghdr msg = {
+        .msg_name = 0,
+        .msg_namelen = 0,
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = MSG_DONTWAIT,
+    };
+    return kernel_recvmsg(sock, &msg, &iov, 1, size, msg.msg_flags);
+}
+
+/* Unix sockets account what they send like datagram ones do */
+static bool http_sock_writeable(struct sock *sk)
+{
+    if (sk->sk_family == AF_UNIX)
+        return sock_writeable(sk);
+    return sk_stream_is_writeable(sk);
+}
+
+static bool http_conn_writable(struct sock *sk)
+{
+    return http_sock_writeable(sk) || READ_ONCE(sk->sk_err) ||
+           (READ_ONCE(sk->sk_shutdown) & SEND_SHUTDOWN);
+}
+
+/* Wait for sk_write_space() after a send found the socket buffer full */
+static bool http_server_wait_send(struct http_conn *conn)
+{
+    long ret = wait_event_timeout(conn->wait,
+                                  http_conn_writable(conn->socket->sk) ||
+                                      http_conn_expired(conn),
+                                  SEND_TIMEOUT);
+
+    if (http_conn_expired(conn)) {
+        pr_debug("connection %llu timed out\n", conn->id);
+        http_stats_inc(HTTP_STAT_REAPED);
+        return false;
+    }
+    if (ret)
+        return true;
+    pr_debug("write timeout\n");
+    http_stats_inc(HTTP_STAT_SEND_ERRORS);
+    return false;
+}
+
+/* Send all of @vec, which is advanced past the bytes sent */
+static int http_server_sendv(struct http_conn *conn,
+                             struct kvec *vec,
+                             size_t nr,
+                             int flags)
+{
+    struct socket *sock = conn->socket;
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = MSG_DONTWAIT | flags,
+    };
+    size_t size = 0;
+    int done = 0;
+
+    for (size_t i = 0; i < nr; i++)
+        size += vec[i].iov_len;
+    while (done < size) {
+        int length = kernel_sendmsg(sock, &msg, vec, nr, size - done);
+        if (length == -EAGAIN) {
+            if (!http_server_wait_send(conn))
+                break;
+            continue;
+        }
+        if (length < 0) {
+            pr_debug("write error: %d\n", length);
+            http_stats_inc(HTTP_STAT_SEND_ERRORS);
+            break;
+        }
+        done += length;
+        conn->sent += length;
+        http_stats_add(HTTP_STAT_BYTES_OUT, length);
+        while (length > 0) {
+            if (length < vec->iov_len) {
+                vec->iov_base += length;
+                vec->iov_len -= length;
+                break;
+            }
+            length -= vec->iov_len;
+            vec++;
+            nr--;
+        }
+    }
+    return done;
+}
+
+static int http_server_send(struct http_conn *conn,
+                            const char *buf,
+                            size_t size,
+                            int flags)
+{
+    struct kvec iov = {.iov_base = (void *) buf, .iov_len = size};
+    return http_server_sendv(conn, &iov, 1, flags);
+}
+
+/* Response bytes produced so far, whether sent or still batched */
+static u64 http_conn_output(const struct http_conn *conn)
+{
+    return conn->sent + conn->batch->queued;
+}
+
+/* Send everything batched so far and release what it referred to */
+static int http_batch_flush(struct http_conn *conn, int flags)
+{
+    struct http_batch *batch = conn->batch;
+    int ret = 0;
+
+    if (batch->nr_vec &&
+        http_server_sendv(conn, batch->vec, batch->nr_vec, flags) !=
+            batch->queued)
+        ret = -EIO;
+    for (size_t i = 0; i < batch->nr_entries; i++)
+        http_cache_put(batch->entries[i]);
+    batch->nr_vec = 0;
+    batch->nr_entries = 0;
+    batch->queued = 0;
+    batch->scratch_used = 0;
+    return ret;
+}
+
+/* Make room for @nr vectors that must go out in the same flush */
+static int http_batch_reserve(struct http_conn *conn, size_t nr)
+{
+    struct http_batch *batch = conn->batch;
+
+    if (batch->nr_vec + nr > BATCH_VECS ||
+        batch->nr_entries == BATCH_VECS)
+        return http_batch_flush(conn, MSG_MORE);
+    return 0;
+}
+
+/* Queue @len bytes at @data in a vector already reserved */
+static void http_batch_push(struct http_batch *batch,
+                            const void *data,
+                            size_t len)
+{
+    batch->vec[batch->nr_vec].iov_base = (void *) data;
+    batch->vec[batch->nr_vec].iov_len = len;
+    batch->nr_vec++;
+    batch->queued += len;
+}
+
+/* Queue @len bytes at @data, which must stay valid until the next flush */
+static int http_batch_ref(struct http_conn *conn, const void *data, size_t len)
+{
+    int ret;
+
+    if (!len)
+        return 0;
+    ret = http_batch_reserve(conn, 1);
+    if (ret < 0)
+        return ret;
+    http_batch_push(conn->batch, data, len);
+    return 0;
+}
+
+/* Make room for @nr vectors and @len bytes of scratch without flushing in
+ * between. Returns where the bytes go; they are queued by
+ * http_batch_commit().
+ */
+static char *http_batch_space(struct http_conn *conn, size_t len, size_t nr)
+{
+    struct http_batch *batch = conn->batch;
+    int ret;
+
+    if (len > RECV_BUFFER_SIZE)
+        return ERR_PTR(-EINVAL);
+    if (len > RECV_BUFFER_SIZE - batch->scratch_used)
+        ret = http_batch_flush(conn, MSG_MORE);
+    else
+        ret = http_batch_reserve(conn, nr);
+    if (ret < 0)
+        return ERR_PTR(ret);
+    if (!batch->scratch)
+        batch->scratch = http_buf_get();
+    return batch->scratch + batch->scratch_used;
+}
+
+/* Queue the @len bytes written at @dst, from http_batch_space() */
+static int http_batch_commit(struct http_conn *conn, char *dst, size_t len)
+{
+    struct http_batch *batch = conn->batch;
+    struct kvec *last;
+
+    batch->scratch_used += len;
+    /* back-to-back copies share one vector */
+    last = batch->nr_vec ? &batch->vec[batch->nr_vec - 1] : NULL;
+    if (last && last->iov_base + last->iov_len == dst) {
+        last->iov_len += len;
+        batch->queued += len;
+        return 0;
+    }
+    return http_batch_ref(conn, dst, len);
+}
+
+/* Queue @len bytes at @data within @entry, which is held until they are
+ * sent even if the batch is flushed in between
+ */
+static int http_batch_ref_entry(struct http_conn *conn,
+                                struct http_cache_entry *entry,
+                                const void *data,
+                                size_t len)
+{
+    struct http_batch *batch = conn->batch;
+    int ret = http_batch_reserve(conn, 1);
+
+    if (ret < 0)
+        return ret;
+    if (!batch->nr_entries || batch->entries[batch->nr_entries - 1] != entry) {
+        http_cache_get(entry);
+        batch->entries[batch->nr_entries++] = entry;
+    }
+    /* no flush from here on, or it would drop @entry under the vector */
+    if (len)
+        http_batch_push(batch, data, len);
+    return 0;
+}
+
+/* Hand @page to TCP by reference instead of copying it into the skb */
+static int http_server_send_page(struct http_conn *conn,
+                                 struct page *page,
+                                 unsigned int offset,
+                                 size_t size,
+                                 int flags)
+{
+    struct socket *sock = conn->socket;
+    int done = 0;
+    while (done < size) {
+        int length;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+        struct bio_vec bvec;
+        struct msghdr msg = {
+            .msg_flags = MSG_SPLICE_PAGES | MSG_DONTWAIT | flags,
+        };
+        bvec_set_page(&bvec, page, size - done, offset + done);
+        iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, &bvec, 1, size - done);
+        length = sock_sendmsg(sock, &msg);
+#else
+        length = kernel_sendpage(sock, page, offset + done, size - done,
+                                 MSG_DONTWAIT | flags);
+#endif
+        if (length == -EAGAIN) {
+            if (!http_server_wait_send(conn))
+                break;
+            continue;
+        }
+        if (length < 0) {
+            pr_debug("sendpage error: %d\n", length);
+            http_stats_inc(HTTP_STAT_SEND_ERRORS);
+            break;
+        }
+        done += length;
+        conn->sent += length;
+        http_stats_add(HTTP_STAT_BYTES_OUT, length);
+    }
+    return done;
+}
+
+/* Send @len bytes of @filp from @pos, page by page out of the page cache */
+static int http_server_send_pages(struct http_conn *conn,
+                                  struct file *filp,
+                                  loff_t pos,
+                                  loff_t len)
+{
+    while (len > 0) {
+        unsigned int offset = offset_in_page(pos);
+        size_t n = min_t(loff_t, PAGE_SIZE - offset, len);
+        struct page *page;
+        int sent;
+
+        page = read_mapping_page(filp->f_mapping, pos >> PAGE_SHIFT, filp);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        sent = http_server_send_page(conn, page, offset, n,
+                                     len > n ? MSG_MORE : 0);
+        put_page(page);
+        if (sent != n)
+            return -EIO;
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Send @len bytes of @filp from @pos through a bounce buffer */
+static int http_server_copy_file(struct http_conn *conn,
+                                 struct file *filp,
+                                 loff_t pos,
+                                 loff_t len)
+{
+    loff_t end = pos + len;
+    char *buf;
+    int err = 0;
+
+    /* kernel_read() is served from the page cache */
+    buf = http_buf_get();
+    while (pos < end) {
+        ssize_t n = kernel_read(filp, buf,
+                                min_t(loff_t, RECV_BUFFER_SIZE, end - pos),
+                                &pos);
+        if (n <= 0) {
+            /* the file shrank: Content-Length can no longer be honoured */
+            err = n ? n : -EIO;
+            break;
+        }
+        if (http_server_send(conn, buf, n, 0) != n) {
+            err = -EIO;
+            break;
+        }
+    }
+    http_buf_put(buf);
+    return err;
+}
+
+/* A token of the request, or "" if it did not appear */
+static const char *http_request_str(const struct http_request *request, int id)
+{
+    const struct http_slice *slice = &request->slices[id];
+    return slice->len ? slice->p : "";
+}
+
+/* The length of the URL's path, without the query */
+static size_t http_request_path_len(const struct http_request *request)
+{
+    const struct http_slice *url = &request->slices[HTTP_SLICE_URL];
+    const struct http_slice *query = &request->slices[HTTP_SLICE_QUERY];
+
+    return query->p ? query->p - 1 - url->p : url->len;
+}
+
+/* NUL-terminate every token in place, keeping the delimiter it replaces.
+ * The query ends with the URL.
+ */
+static void http_request_terminate(struct http_request *request)
+{
+    for (int i = 0; i < NR_HTTP_SLICES; i++) {
+        struct http_slice *slice = &request->slices[i];
+
+        if (slice->len && i != HTTP_SLICE_QUERY) {
+            request->ends[i] = slice->p[slice->len];
+            slice->p[slice->len] = '\0';
+        }
+    }
+}
+
+/* Put back what http_request_terminate() replaced */
+static void http_request_unterminate(struct http_request *request)
+{
+    for (int i = 0; i < NR_HTTP_SLICES; i++) {
+        struct http_slice *slice = &request->slices[i];
+
+        if (slice->len && i != HTTP_SLICE_QUERY)
+            slice->p[slice->len] = request->ends[i];
+    }
+}
+
+static enum http_status http_status_from_errno(int err)
+{
+    switch (err) {
+    case -ENOENT:
+    case -ENOTDIR:
+        return HTTP_STATUS_NOT_FOUND;
+    case -EACCES:
+    case -EPERM:
+        return HTTP_STATUS_FORBIDDEN;
+    case -EINVAL:
+        return HTTP_STATUS_BAD_REQUEST;
+    case -ENAMETOOLONG:
+        return HTTP_STATUS_URI_TOO_LONG;
+    default:
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+}
+
+static int http_server_send_status(struct http_request *request,
+                                   enum http_status status,
+                                   int keep_alive)
+{
+    char *buf = http_batch_space(request->conn, HTTP_STATUS_RESPONSE_MAX, 1);
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    request->status = status;
+    return http_batch_commit(
+        request->conn, buf,
+        http_put_status_response(buf, status, keep_alive) - buf);
+}
+
+/* The fixed reply when no document root is set */
+static int http_server_send_hello(struct http_request *request,
+                                  int keep_alive)
+{
+    char *buf = http_batch_space(request->conn, RESPONSE_HEADER_MAX, 1);
+    char *p;
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    request->status = HTTP_STATUS_OK;
+    p = http_put_status(buf, HTTP_STATUS_OK);
+    p = http_put_lit(p, "Content-Type: text/plain" CRLF
+                        "Content-Length: 12" CRLF);
+    p = http_put_head_end(p, keep_alive);
+    p = http_put_lit(p, "Hello World!");
+    return http_batch_commit(request->conn, buf, p - buf);
+}
+
+/* Send the head of a streamed response; the body follows through
+ * http_stream_write() and http_stream_end()
+ */
+static int http_stream_begin(struct http_stream *stream,
+                             struct http_request *request,
+                             enum http_status status,
+                             const char *mime)
+{
+    char *buf = http_batch_space(request->conn, RESPONSE_HEADER_MAX, 1);
+    char *p;
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    stream->conn = request->conn;
+    stream->chunk = NULL;
+    stream->chunked = request->http11;
+    stream->discard = request->method == HTTP_HEAD;
+    /* without chunks only closing the connection ends the body */
+    if (!stream->chunked)
+        request->keep_alive = false;
+    request->status = status;
+    p = http_put_status(buf, status);
+    p = http_put_lit(p, "Content-Type: ");
+    p = http_put(p, mime, strlen(mime));
+    p = http_put_lit(p, CRLF);
+    if (stream->chunked)
+        p = http_put_lit(p, "Transfer-Encoding: chunked" CRLF);
+    p = http_put_head_end(p, request->keep_alive);
+    return http_batch_commit(request->conn, buf, p - buf);
+}
+
+/* Frame the open chunk and queue it */
+static int http_stream_close(struct http_stream *stream)
+{
+    char *chunk = stream->chunk;
+    size_t len = stream->len;
+
+    stream->chunk = NULL;
+    if (!chunk || !len)
+        return 0;
+    if (!stream->chunked)
+        return http_batch_commit(stream->conn, chunk, len);
+    /* leading zeros keep the size at the width reserved for it */
+    BUILD_BUG_ON(RECV_BUFFER_SIZE > 0xffff);
+    for (int i = 3; i >= 0; i--, len >>= 4)
+        chunk[i] = hex_asc_lo(len);
+    memcpy(chunk + 4, CRLF, 2);
+    memcpy(chunk + CHUNK_HEAD_LEN + stream->len, CRLF, 2);
+    return http_batch_commit(stream->conn, chunk,
+                             CHUNK_FRAME_LEN + stream->len);
+}
+
+/* Where the next @len bytes of body go, at most RECV_BUFFER_SIZE less the
+ * framing; they count once added to stream->len
+ */
+static char *http_stream_space(struct http_stream *stream, size_t len)
+{
+    struct http_batch *batch = stream->conn->batch;
+    size_t frame = stream->chunked ? CHUNK_FRAME_LEN : 0;
+    char *chunk;
+    int ret;
+
+    if (stream->chunk && len <= stream->room - stream->len)
+        goto out;
+    ret = http_stream_close(stream);
+    if (ret < 0)
+        return ERR_PTR(ret);
+    /* take all the scratch left, unless that is too little to bother */
+    chunk = http_batch_space(stream->conn,
+                             max_t(size_t, len + frame, STREAM_CHUNK_MIN), 1);
+    if (IS_ERR(chunk))
+        return chunk;
+    stream->chunk = chunk;
+    stream->len = 0;
+    stream->room = batch->scratch + RECV_BUFFER_SIZE - chunk - frame;
+out:
+    return stream->chunk + (frame ? CHUNK_HEAD_LEN : 0) + stream->len;
+}
+
+static int http_stream_write(struct http_stream *stream,
+                             const void *data,
+                             size_t len)
+{
+    if (stream->discard)
+        return 0;
+    while (len) {
+        char *p = http_stream_space(stream, 1);
+        size_t n;
+
+        if (IS_ERR(p))
+            return PTR_ERR(p);
+        n = min(len, stream->room - stream->len);
+        memcpy(p, data, n);
+        stream->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copy a string literal into the body */
+#define http_stream_lit(stream, s) http_stream_write(stream, s, sizeof(s) - 1)
+
+/* Write @len bytes at @s escaped for HTML text and attribute values, or
+ * percent-encoded as a URL path segment if @url is set
+ */
+static int http_stream_escape(struct http_stream *stream,
+                              const char *s,
+                              size_t len,
+                              bool url)
+{
+    if (stream->discard)
+        return 0;
+    while (len--) {
+        unsigned char c = *s++;
+        char *start = http_stream_space(stream, 6), *p = start;
+
+        if (IS_ERR(p))
+            return PTR_ERR(p);
+        if (url && !isalnum(c) && !strchr("-._~", c)) {
+            *p++ = '%';
+            p = hex_byte_pack_upper(p, c);
+        } else if (c == '&') {
+            p = http_put_lit(p, "&amp;");
+        } else if (c == '<') {
+            p = http_put_lit(p, "&lt;");
+        } else if (c == '>') {
+            p = http_put_lit(p, "&gt;");
+        } else if (c == '"') {
+            p = http_put_lit(p, "&quot;");
+        } else if (c == '\'') {
+            p = http_put_lit(p, "&#39;");
+        } else {
+            *p++ = c;
+        }
+        stream->len += p - start;
+    }
+    return 0;
+}
+
+/* Finish the body with the last, empty chunk */
+static int http_stream_end(struct http_stream *stream)
+{
+    char *buf;
+    int ret;
+
+    if (stream->discard)
+        return 0;
+    ret = http_stream_close(stream);
+    if (ret < 0 || !stream->chunked)
+        return ret;
+    buf = http_batch_space(stream->conn, sizeof("0" CRLF CRLF) - 1, 1);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    return http_batch_commit(stream->conn, buf,
+                             http_put_lit(buf, "0" CRLF CRLF) - buf);
+}
+
+enum http_method khttpd_request_method(const struct http_request *request)
+{
+    return request->method;
+}
+EXPORT_SYMBOL(khttpd_request_method);
+
+const char *khttpd_request_url(const struct http_request *request)
+{
+    return http_request_str(request, HTTP_SLICE_URL);
+}
+EXPORT_SYMBOL(khttpd_request_url);
+
+const char *khttpd_request_query(const struct http_request *request)
+{
+    return http_request_str(request, HTTP_SLICE_QUERY);
+}
+EXPORT_SYMBOL(khttpd_request_query);
+
+const char *khttpd_request_header(const struct http_request *request,
+                                  enum http_header_id id)
+{
+    if (id >= NR_HTTP_HEADERS)
+        return "";
+    return http_request_str(request, id);
+}
+EXPORT_SYMBOL(khttpd_request_header);
+
+int khttpd_reply(struct http_request *request,
+                 enum http_status status,
+                 const char *mime,
+                 const void *body,
+                 size_t len)
+{
+    /* an unframed stream copies the body into the batch */
+    struct http_stream stream = {
+        .conn = request->conn,
+        .discard = request->method == HTTP_HEAD,
+    };
+    char *buf = http_batch_space(request->conn, RESPONSE_HEADER_MAX, 1);
+    char *p;
+    int ret;
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    request->status = status;
+    p = http_put_status(buf, status);
+    p = http_put_lit(p, "Content-Type: ");
+    p = http_put(p, mime, strlen(mime));
+    p = http_put_lit(p, CRLF "Content-Length: ");
+    p = http_put_u64(p, len);
+    p = http_put_lit(p, CRLF);
+    p = http_put_head_end(p, request->keep_alive);
+    ret = http_batch_commit(request->conn, buf, p - buf);
+    if (!ret)
+        ret = http_stream_write(&stream, body, len);
+    if (!ret)
+        ret = http_stream_close(&stream);
+    return ret;
+}
+EXPORT_SYMBOL(khttpd_reply);
+
+int khttpd_stream_begin(struct http_request *request,
+                        enum http_status status,
+                        const char *mime)
+{
+    return http_stream_begin(&request->stream, request, status, mime);
+}
+EXPORT_SYMBOL(khttpd_stream_begin);
+
+int khttpd_stream_write(struct http_request *request,
+                        const void *data,
+                        size_t len)
+{
+    return http_stream_write(&request->stream, data, len);
+}
+EXPORT_SYMBOL(khttpd_stream_write);
+
+int khttpd_stream_end(struct http_request *request)
+{
+    return http_stream_end(&request->stream);
+}
+EXPORT_SYMBOL(khttpd_stream_end);
+
+/* Content-Encoding, Vary and the validators of @body */
+static char *http_put_representation(char *p, const struct http_body *body)
+{
+    p = http_put_content_encoding(p, body->encoding);
+    if (body->vary)
+        p = http_put_lit(p, "Vary: Accept-Encoding" CRLF);
+    return http_put_validators(p, body->validator);
+}
+
+/* Build the file response header up to, but excluding, Date and Connection,
+ * which differ between responses of a cached entry
+ */
+static int http_server_file_header(char *buf, const struct http_body *body)
+{
+    char *p;
+
+    p = http_put_status(buf, HTTP_STATUS_OK);
+    p = http_put_lit(p, "Content-Type: ");
+    p = http_put(p, body->mime, strlen(body->mime));
+    p = http_put_lit(p, CRLF "Content-Length: ");
+    p = http_put_u64(p, body->size);
+    p = http_put_lit(p, CRLF "Accept-Ranges: bytes" CRLF);
+    p = http_put_representation(p, body);
+    return p - buf;
+}
+
+static bool http_request_not_modified(const struct http_request *request,
+                                      const struct http_validator *validator)
+{
+    return http_not_modified(
+        validator, http_request_str(request, HTTP_HEADER_IF_NONE_MATCH),
+        http_request_str(request, HTTP_HEADER_IF_MODIFIED_SINCE));
+}
+
+/* Confirm that the client's copy is current, without a body */
+static int http_server_send_not_modified(
+    struct http_request *request,
+    const struct http_validator *validator,
+    bool vary,
+    int keep_alive)
+{
+    char *buf = http_batch_space(request->conn, RESPONSE_HEADER_MAX, 1);
+    char *p;
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    request->status = HTTP_STATUS_NOT_MODIFIED;
+    p = http_put_status(buf, HTTP_STATUS_NOT_MODIFIED);
+    if (vary)
+        p = http_put_lit(p, "Vary: Accept-Encoding" CRLF);
+    p = http_put_validators(p, validator);
+    p = http_put_head_end(p, keep_alive);
+    return http_batch_commit(request->conn, buf, p - buf);
+}
+
+/* Send @len bytes of @body from @pos after everything batched so far */
+static int http_server_send_body(struct http_conn *conn,
+                                 const struct http_body *body,
+                                 loff_t pos,
+                                 loff_t len)
+{
+    int ret;
+
+    if (body->entry)
+        return http_batch_ref_entry(
+            conn, body->entry, body->entry->data + body->entry->hdr_len + pos,
+            len);
+    /* the body is streamed past the batch; the header shares its segment */
+    ret = http_batch_flush(conn, MSG_MORE);
+    if (ret < 0)
+        return ret;
+    if (body->zerocopy)
+        return http_server_send_pages(conn, body->filp, pos, len);
+    return http_server_copy_file(conn, body->filp, pos, len);
+}
+
+static int http_server_send_unsatisfiable(struct http_request *request,
+                                          const struct http_body *body,
+                                          int keep_alive)
+{
+    char *buf = http_batch_space(request->conn, RESPONSE_HEADER_MAX, 1);
+    char *p;
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    request->status = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    p = http_put_status(buf, HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+    p = http_put_content_range(p, NULL, body->size);
+    p = http_put_lit(p, "Content-Length: 0" CRLF);
+    p = http_put_head_end(p, keep_alive);
+    return http_batch_commit(request->conn, buf, p - buf);
+}
+
+static int http_server_send_range(struct http_request *request,
+                                  const struct http_body *body,
+                                  const struct http_range *range,
+                                  int keep_alive)
+{
+    char *buf = http_batch_space(request->conn, RESPONSE_HEADER_MAX, 1);
+    char *p;
+    int ret;
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    request->status = HTTP_STATUS_PARTIAL_CONTENT;
+    p = http_put_status(buf, HTTP_STATUS_PARTIAL_CONTENT);
+    p = http_put_lit(p, "Content-Type: ");
+    p = http_put(p, body->mime, strlen(body->mime));
+    p = http_put_lit(p, CRLF "Content-Length: ");
+    p = http_put_u64(p, range->len);
+    p = http_put_lit(p, CRLF);
+    p = http_put_content_range(p, range, body->size);
+    p = http_put_representation(p, body);
+    p = http_put_head_end(p, keep_alive);
+    ret = http_batch_commit(request->conn, buf, p - buf);
+    if (ret < 0)
+        return ret;
+    return http_server_send_body(request->conn, body, range->start,
+                                 range->len);
+}
+
+/* The delimiter and headers in front of a part of a multipart body */
+static char *http_put_part_head(char *p,
+                                const char *boundary,
+                                const struct http_body *body,
+                                const struct http_range *range)
+{
+    p = http_put_lit(p, CRLF "--");
+    p = http_put(p, boundary, BOUNDARY_LEN);
+    p = http_put_lit(p, CRLF "Content-Type: ");
+    p = http_put(p, body->mime, strlen(body->mime));
+    p = http_put_lit(p, CRLF);
+    p = http_put_content_range(p, range, body->size);
+    return http_put_lit(p, CRLF);
+}
+
+static int http_server_send_multipart(struct http_request *request,
+                                      const struct http_body *body,
+                                      const struct http_range *ranges,
+                                      int nr,
+                                      int keep_alive)
+{
+    struct http_conn *conn = request->conn;
+    char boundary[BOUNDARY_LEN], part[RESPONSE_HEADER_MAX];
+    loff_t len = sizeof(CRLF "----" CRLF) - 1 + BOUNDARY_LEN;
+    char *buf, *p;
+    int ret;
+
+    /* the top bit keeps all BOUNDARY_LEN hex digits */
+    http_put_x64(boundary, get_random_u64() | 1ULL << 63);
+    for (int i = 0; i < nr; i++)
+        len += http_put_part_head(part, boundary, body, &ranges[i]) - part +
+               ranges[i].len;
+
+    buf = http_batch_space(conn, RESPONSE_HEADER_MAX, 1);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    request->status = HTTP_STATUS_PARTIAL_CONTENT;
+    p = http_put_status(buf, HTTP_STATUS_PARTIAL_CONTENT);
+    p = http_put_lit(p, "Content-Type: multipart/byteranges; boundary=");
+    p = http_put(p, boundary, BOUNDARY_LEN);
+    p = http_put_lit(p, CRLF "Content-Length: ");
+    p = http_put_u64(p, len);
+    p = http_put_lit(p, CRLF);
+    p = http_put_representation(p, body);
+    p = http_put_head_end(p, keep_alive);
+    ret = http_batch_commit(conn, buf, p - buf);
+
+    for (int i = 0; i < nr && !ret; i++) {
+        buf = http_batch_space(conn, RESPONSE_HEADER_MAX, 1);
+        if (IS_ERR(buf))
+            return PTR_ERR(buf);
+        p = http_put_part_head(buf, boundary, body, &ranges[i]);
+        ret = http_batch_commit(conn, buf, p - buf);
+        if (!ret)
+            ret = http_server_send_body(conn, body, ranges[i].start,
+                                        ranges[i].len);
+    }
+    if (ret < 0)
+        return ret;
+
+    buf = http_batch_space(conn, RESPONSE_HEADER_MAX, 1);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    p = http_put_lit(buf, CRLF "--");
+    p = http_put(p, boundary, BOUNDARY_LEN);
+    p = http_put_lit(p, "--" CRLF);
+    return http_batch_commit(conn, buf, p - buf);
+}
+
+/* Answer a GET carrying a Range header. Returns 1 if there is none or it
+ * does not apply, and the whole body is to be sent instead.
+ */
+static int http_server_send_ranges(struct http_request *request,
+                                   const struct http_body *body,
+                                   int keep_alive)
+{
+    struct http_range ranges[HTTP_RANGES_MAX];
+    int nr;
+
+    if (request->method != HTTP_GET ||
+        !request->slices[HTTP_HEADER_RANGE].len ||
+        !http_if_range(body->validator,
+                       http_request_str(request, HTTP_HEADER_IF_RANGE)))
+        return 1;
+    nr = http_parse_ranges(http_request_str(request, HTTP_HEADER_RANGE),
+                           body->size, ranges, ARRAY_SIZE(ranges));
+    if (nr < 0)
+        return 1;
+    if (!nr)
+        return http_server_send_unsatisfiable(request, body, keep_alive);
+    if (nr == 1)
+        return http_server_send_range(request, body, ranges, keep_alive);
+    return http_server_send_multipart(request, body, ranges, nr, keep_alive);
+}
+
+/* Queue the response in @entry, taking over the caller's reference */
+static int http_server_send_cached(struct http_request *request,
+                                   struct http_cache_entry *entry,
+                                   int keep_alive)
+{
+    struct http_conn *conn = request->conn;
+    struct http_batch *batch = conn->batch;
+    struct http_body body = {
+        .entry = entry,
+        .size = entry->len - entry->hdr_len,
+        .mime = entry->mime,
+        .validator = &entry->validator,
+        .encoding = entry->encoding,
+        .vary = entry->vary,
+    };
+    size_t len;
+    char *end;
+    int ret;
+
+    /* partial responses take references of their own */
+    ret = http_server_send_ranges(request, &body, keep_alive);
+    if (ret <= 0) {
+        http_cache_put(entry);
+        return ret;
+    }
+
+    /* all three vectors must be sent before the entry is released */
+    end = http_batch_space(conn, HTTP_HEAD_END_MAX, 3);
+    if (IS_ERR(end)) {
+        http_cache_put(entry);
+        return PTR_ERR(end);
+    }
+    batch->entries[batch->nr_entries++] = entry;
+    request->status = HTTP_STATUS_OK;
+    /* queued into the room made above: a flush now would drop @entry */
+    http_batch_push(batch, entry->data, entry->hdr_len);
+    len = http_put_head_end(end, keep_alive) - end;
+    batch->scratch_used += len;
+    http_batch_push(batch, end, len);
+    if (request->method != HTTP_HEAD && body.size)
+        http_batch_push(batch, entry->data + entry->hdr_len, body.size);
+    return 0;
+}
+
+/* Read a small file into a new response cache entry, found by requests
+ * preferring @variant
+ */
+static struct http_cache_entry *http_server_cache_file(
+    struct http_request *request,
+    const struct http_body *body,
+    enum http_encoding variant)
+{
+    struct http_cache_origin origin;
+    struct http_cache_entry *entry;
+    loff_t pos = 0;
+
+    if (http_cache_watch(body->filp, &origin) < 0)
+        return NULL;
+    entry = http_cache_alloc(http_request_str(request, HTTP_HEADER_HOST),
+                             http_request_str(request, HTTP_SLICE_URL),
+                             variant, RESPONSE_HEADER_MAX + body->size);
+    if (!entry)
+        return NULL;
+    entry->validator = *body->validator;
+    entry->mime = body->mime;
+    entry->encoding = body->encoding;
+    entry->vary = body->vary;
+    entry->hdr_len = http_server_file_header(entry->data, body);
+    while (pos < body->size) {
+        ssize_t n =
+            kernel_read(body->filp, entry->data + entry->hdr_len + pos,
+                        body->size - pos, &pos);
+        if (n <= 0) {
+            http_cache_put(entry);
+            return NULL;
+        }
+    }
+    entry->len = entry->hdr_len + body->size;
+    http_cache_insert(entry, &origin);
+    return entry;
+}
+
+/* Compress a file into a new response cache entry for @body, which names
+ * the coding and validator of the result but the size of the original
+ */
+static struct http_cache_entry *http_server_compress_file(
+    struct http_request *request,
+    const struct http_body *body)
+{
+    struct http_body encoded = *body;
+    struct http_cache_origin origin;
+    struct http_cache_entry *entry;
+    char *data;
+    ssize_t len;
+
+    if (http_cache_watch(body->filp, &origin) < 0)
+        return NULL;
+    len = http_compress_file(body->filp, body->size, body->encoding, &data);
+    if (len < 0)
+        return NULL;
+    entry = http_cache_alloc(http_request_str(request, HTTP_HEADER_HOST),
+                             http_request_str(request, HTTP_SLICE_URL),
+                             body->encoding, RESPONSE_HEADER_MAX + len);
+    if (entry) {
+        encoded.size = len;
+        entry->validator = *body->validator;
+        entry->mime = body->mime;
+        entry->vary = true;
+        entry->hdr_len = http_server_file_header(entry->data, &encoded);
+        memcpy(entry->data + entry->hdr_len, data, len);
+        entry->len = entry->hdr_len + len;
+        http_cache_insert(entry, &origin);
+    }
+    kvfree(data);
+    return entry;
+}
+
+/* Answer with @body, an open file, caching it for requests preferring
+ * @variant where it is small enough
+ */
+static int http_server_send_file_body(struct http_request *request,
+                                      struct http_body *body,
+                                      enum http_encoding variant,
+                                      int keep_alive)
+{
+    struct http_conn *conn = request->conn;
+    char *header;
+    int len, ret;
+
+    if (http_request_not_modified(request, body->validator))
+        return http_server_send_not_modified(request, body->validator,
+                                             body->vary, keep_alive);
+
+    if (request->method == HTTP_GET && http_cache_admit(body->size)) {
+        struct http_cache_entry *entry =
+            http_server_cache_file(request, body, variant);
+        if (entry)
+            return http_server_send_cached(request, entry, keep_alive);
+    }
+
+    body->zerocopy =
+        body->size >= zerocopy_min && http_file_can_splice(body->filp);
+    ret = http_server_send_ranges(request, body, keep_alive);
+    if (ret <= 0)
+        return ret;
+
+    header = http_batch_space(conn, RESPONSE_HEADER_MAX, 1);
+    if (IS_ERR(header))
+        return PTR_ERR(header);
+    request->status = HTTP_STATUS_OK;
+    len = http_server_file_header(header, body);
+    len = http_put_head_end(header + len, keep_alive) - header;
+    ret = http_batch_commit(conn, header, len);
+    if (ret < 0 || request->method == HTTP_HEAD)
+        return ret;
+    return http_server_send_body(conn, body, 0, body->size);
+}
+
+/* Answer with @body in @encoding: from a precompressed sibling file if
+ * there is one, or compressed once into the cache. Returns 1 if the file
+ * is to be sent as it is.
+ */
+static int http_server_send_encoded(struct http_request *request,
+                                    const struct http_body *body,
+                                    enum http_encoding encoding,
+                                    int keep_alive)
+{
+    struct http_validator validator = *body->validator;
+    struct http_body encoded = *body;
+    struct http_cache_entry *entry;
+    struct file *sibling;
+    int ret;
+
+    encoded.encoding = encoding;
+    encoded.validator = &validator;
+    if (encoding == HTTP_ENCODING_GZIP) {
+        sibling = http_file_open_sibling(
+            http_request_str(request, HTTP_SLICE_URL), body->index, ".gz");
+        if (!IS_ERR(sibling)) {
+            encoded.filp = sibling;
+            encoded.size = i_size_read(file_inode(sibling));
+            http_validator_init(&validator, file_inode(sibling));
+            ret = http_server_send_file_body(request, &encoded, encoding,
+                                             keep_alive);
+            filp_close(sibling, NULL);
+            return ret;
+        }
+    }
+
+    /* HEAD compresses too, its Content-Length must match GET's */
+    if (!http_compress_admit(body->size) || !http_cache_admit(body->size))
+        return 1;
+    http_validator_encode(&validator, encoding);
+    if (http_request_not_modified(request, &validator))
+        return http_server_send_not_modified(request, &validator, true,
+                                             keep_alive);
+    entry = http_server_compress_file(request, &encoded);
+    if (!entry)
+        return 1;
+    return http_server_send_cached(request, entry, keep_alive);
+}
+
+static int http_server_send_file(struct http_request *request,
+                                 struct file *filp,
+                                 bool index,
+                                 enum http_encoding encoding,
+                                 int keep_alive)
+{
+    struct http_validator validator;
+    struct http_body body = {
+        .filp = filp,
+        .size = i_size_read(file_inode(filp)),
+        .mime = http_file_mime(filp),
+        .validator = &validator,
+        .vary = http_file_compressible(filp),
+        .index = index,
+    };
+    int ret;
+
+    http_validator_init(&validator, file_inode(filp));
+    if (encoding != HTTP_ENCODING_IDENTITY && body.vary) {
+        ret = http_server_send_encoded(request, &body, encoding, keep_alive);
+        if (ret <= 0)
+            return ret;
+    }
+    /* cached under the coding asked for, so that files which do not
+     * compress are not tried again; types never compressed are cached once
+     */
+    return http_server_send_file_body(
+        request, &body, body.vary ? encoding : HTTP_ENCODING_IDENTITY,
+        keep_alive);
+}
+
+/* Write a list item linking to @dirent in the directory at @base */
+static int http_stream_put_entry(struct http_stream *stream,
+                                 const char *base,
+                                 size_t base_len,
+                                 const struct http_file_dirent *dirent)
+{
+    int ret;
+
+    ret = http_stream_lit(stream, "<li><a href=\"");
+    if (!ret)
+        ret = http_stream_escape(stream, base, base_len, false);
+    if (!ret && base[base_len - 1] != '/')
+        ret = http_stream_lit(stream, "/");
+    if (!ret)
+        ret = http_stream_escape(stream, dirent->name, dirent->len, true);
+    if (!ret)
+        ret = dirent->dir ? http_stream_lit(stream, "/\">")
+                          : http_stream_lit(stream, "\">");
+    if (!ret)
+        ret = http_stream_escape(stream, dirent->name, dirent->len, false);
+    if (!ret)
+        ret = dirent->dir ? http_stream_lit(stream, "/</a></li>\n")
+                          : http_stream_lit(stream, "</a></li>\n");
+    return ret;
+}
+
+/* List @dir, in the order the filesystem returns its entries */
+static int http_server_send_listing(struct http_request *request,
+                                    struct file *dir)
+{
+    const struct http_slice *url = &request->slices[HTTP_SLICE_URL];
+    size_t len = http_request_path_len(request), parent;
+    struct http_stream stream;
+    char *buf;
+    int ret;
+
+    /* links are absolute, so they work whether the URL ends in '/' or not */
+    while (len > 1 && url->p[len - 1] == '/')
+        len--;
+    ret = http_stream_begin(&stream, request, HTTP_STATUS_OK,
+                            "text/html; charset=utf-8");
+    if (ret < 0 || stream.discard)
+        return ret;
+
+    ret = http_stream_lit(&stream, "<!DOCTYPE html>\n<title>Index of ");
+    if (!ret)
+        ret = http_stream_escape(&stream, url->p, len, false);
+    if (!ret)
+        ret = http_stream_lit(&stream, "</title>\n<h1>Index of ");
+    if (!ret)
+        ret = http_stream_escape(&stream, url->p, len, false);
+    if (!ret)
+        ret = http_stream_lit(&stream, "</h1>\n<ul>\n");
+    if (!ret && len > 1) {
+        for (parent = len; url->p[parent - 1] != '/'; parent--)
+            ;
+        ret = http_stream_lit(&stream, "<li><a href=\"");
+        if (!ret)
+            ret = http_stream_escape(&stream, url->p, parent, false);
+        if (!ret)
+            ret = http_stream_lit(&stream, "\">../</a></li>\n");
+    }
+    if (ret < 0)
+        return ret;
+
+    /* entries are read a buffer at a time and sent between reads */
+    buf = http_buf_get();
+    while ((ret = http_file_readdir(dir, buf, RECV_BUFFER_SIZE)) > 0) {
+        for (int pos = 0; pos < ret;) {
+            const struct http_file_dirent *dirent =
+                (const struct http_file_dirent *) (buf + pos);
+            int err = http_stream_put_entry(&stream, url->p, len, dirent);
+
+            if (err < 0) {
+                ret = err;
+                goto out;
+            }
+            pos += http_file_dirent_size(dirent->len);
+        }
+    }
+out:
+    http_buf_put(buf);
+    if (ret < 0)
+        return ret;
+    ret = http_stream_lit(&stream, "</ul>\n");
+    if (!ret)
+        ret = http_stream_end(&stream);
+    return ret;
+}
+
+/* Request headers never forwarded besides hop-by-hop ones: khttpd answers
+ * Expect itself
+ */
+static const char *const proxy_request_drop[] = {"Expect", NULL};
+
+/* and for a GET or HEAD forwarded once complete, whose body was dropped */
+static const char *const proxy_request_drop_body[] = {
+    "Expect",
+    "Content-Length",
+    NULL,
+};
+
+/* Response headers khttpd puts in itself */
+static const char *const proxy_response_drop[] = {"Date", NULL};
+
+static int http_proxy_put_line(void *arg, const char *line, size_t len)
+{
+    char **p = arg;
+
+    *p = http_put(*p, line, len);
+    *p = http_put_lit(*p, CRLF);
+    return 0;
+}
+
+static int http_proxy_stream_line(void *arg, const char *line, size_t len)
+{
+    struct http_stream *stream = arg;
+    int ret = http_stream_write(stream, line, len);
+
+    return ret ? ret : http_stream_lit(stream, CRLF);
+}
+
+/* Open or reuse a backend connection and send the head on it */
+/* Send the head over a pooled connection, or a new one if @fresh. A
+ * pooled one the backend closed meanwhile is given up for a new one.
+ */
+static int http_proxy_send_head(struct http_proxy *proxy, bool fresh)
+{
+    struct kvec vec = {.iov_base = proxy->head, .iov_len = proxy->head_len};
+    struct http_upstream *up =
+        fresh ? http_upstream_connect() : http_upstream_get();
+    bool reused;
+    int ret;
+
+    if (IS_ERR(up))
+        return PTR_ERR(up);
+    ret = http_upstream_send(up, &vec, 1, proxy->head_len);
+    if (!ret) {
+        proxy->upstream = up;
+        return 0;
+    }
+    reused = up->reused;
+    http_upstream_put(up, false);
+    /* the backend never saw all of the head, so sending it again is safe */
+    return reused ? http_proxy_send_head(proxy, true) : ret;
+}
+
+/* Send the head of @request to the backend: the request line in HTTP/1.1,
+ * the header lines but those in @drop, and X-Forwarded-For. Failures are
+ * answered once the request is complete.
+ */
+static void http_proxy_begin(struct http_request *request,
+                             bool chunked,
+                             const char *const *drop)
+{
+    struct http_conn *conn = request->conn;
+    struct http_proxy *proxy = &request->proxy;
+    const struct http_slice *url = &request->slices[HTTP_SLICE_URL];
+    const char *method = http_method_str(request->method);
+    const char *end = conn->in + conn->in_len, *lines;
+    size_t len = 0;
+    char *p;
+    int flags;
+
+    proxy->active = true;
+    proxy->chunked = chunked;
+    http_stats_inc(HTTP_STAT_PROXIED);
+    /* the header lines follow the request line, all still in the buffer */
+    http_request_unterminate(request);
+    lines = memchr(url->p + url->len, '\n', end - url->p - url->len);
+    if (lines)
+        len = http_proxy_head_len(++lines, end - lines);
+    if (len)
+        proxy->head = kvmalloc(
+            strlen(method) + url->len + 2 * len + PROXY_HEAD_EXTRA, GFP_KERNEL);
+    if (!proxy->head) {
+        http_request_terminate(request);
+        proxy->error = -ENOMEM;
+        return;
+    }
+    p = http_put(proxy->head, method, strlen(method));
+    p = http_put_lit(p, " ");
+    p = http_put(p, url->p, url->len);
+    p = http_put_lit(p, " HTTP/1.1" CRLF);
+    /* lines ending in a bare LF grow by a byte each */
+    flags = http_proxy_headers(lines, len, drop, http_proxy_put_line, &p);
+    http_request_terminate(request);
+    if (flags < 0) {
+        proxy->error = flags;
+        return;
+    }
+    if (chunked)
+        p = http_put_lit(p, "Transfer-Encoding: chunked" CRLF);
+    if (conn->peer.sin6_family == AF_INET || conn->peer.sin6_family == AF_INET6)
+        p += sprintf(p, "X-Forwarded-For: %pISc" CRLF, &conn->peer);
+    p = http_put_lit(p, CRLF);
+    proxy->head_len = p - proxy->head;
+
+    proxy->error = http_proxy_send_head(proxy, false);
+    /* the client holds the body back until told to go on */
+    if (!proxy->error && (flags & HTTP_PROXY_CONTINUE) && request->http11)
+        http_batch_ref(conn, HTTP_RESPONSE_100, strlen(HTTP_RESPONSE_100));
+}
+
+/* Forward @request from its headers on, so that its body streams through
+ * to the backend instead of filling the input buffer
+ */
+static void http_proxy_start(struct http_request *request, bool chunked)
+{
+    struct http_proxy *proxy = &request->proxy;
+    struct http_slice url = request->slices[HTTP_SLICE_URL];
+
+    http_proxy_begin(request, chunked, proxy_request_drop);
+    /* only the URL outlives the head, for the log */
+    proxy->url = kmemdup_nul(url.p, url.len, GFP_KERNEL);
+    memset(request->slices, 0, sizeof(request->slices));
+    if (proxy->url) {
+        request->slices[HTTP_SLICE_URL].p = proxy->url;
+        request->slices[HTTP_SLICE_URL].len = url.len;
+    }
+}
+
+/* Pass @len bytes of request body on. Once that failed the rest is
+ * dropped, and the request answered with an error when complete.
+ */
+static void http_proxy_body(struct http_request *request,
+                            const char *p,
+                            size_t len)
+{
+    struct http_proxy *proxy = &request->proxy;
+    char size[sizeof(u64) * 2 + 2];
+    struct kvec vec[3] = {
+        {.iov_base = size},
+        {.iov_base = (void *) p, .iov_len = len},
+        {.iov_base = CRLF, .iov_len = 2},
+    };
+    int ret;
+
+    if (!proxy->upstream)
+        return;
+    proxy->body = true;
+    if (proxy->chunked) {
+        vec[0].iov_len = http_put_lit(http_put_x64(size, len), CRLF) - size;
+        ret = http_upstream_send(proxy->upstream, vec, 3,
+                                 vec[0].iov_len + len + 2);
+    } else {
+        ret = http_upstream_send(proxy->upstream, &vec[1], 1, len);
+    }
+    if (ret < 0) {
+        proxy->error = ret;
+        http_upstream_put(proxy->upstream, false);
+        proxy->upstream = NULL;
+    }
+}
+
+static void http_proxy_release(struct http_proxy *proxy)
+{
+    if (proxy->upstream)
+        http_upstream_put(proxy->upstream, false);
+    kvfree(proxy->head);
+    kfree(proxy->url);
+    memset(proxy, 0, sizeof(*proxy));
+}
+
+/* A response being relayed from the backend. Its head is read whole into
+ * the upstream buffer, after any interim responses; body bytes go straight
+ * on to the client, so the buffer is reused for each read.
+ */
+struct http_proxy_response {
+    struct http_request *request;
+    struct http_stream stream;
+    size_t head; /* where the response being parsed starts in the buffer */
+    size_t len;  /* bytes in the buffer */
+    bool sent;   /* its head went out to the client */
+    bool done;
+    bool reuse; /* the backend connection can take another request */
+    int error;
+};
+
+static int http_proxy_on_headers_complete(http_parser *parser)
+{
+    struct http_proxy_response *resp = parser->data;
+    struct http_request *request = resp->request;
+    struct http_stream *stream = &resp->stream;
+    const char *head = request->proxy.upstream->buf + resp->head;
+    size_t len = http_proxy_head_len(head, resp->len - resp->head);
+    const char *lines = memchr(head, '\n', len) + 1;
+    const char *status = memchr(head, ' ', lines - head);
+    size_t status_len = lines - 1 - status;
+    bool body, chunked;
+    char *p;
+    int ret;
+
+    /* interim responses are not passed on; the final one follows */
+    if (parser->status_code < 200) {
+        resp->head += len;
+        return 0;
+    }
+    body = request->method != HTTP_HEAD && parser->status_code != 204 &&
+           parser->status_code != 304;
+    /* bodies of unknown length are chunked, or ended by closing */
+    chunked = body && !(parser->flags & F_CONTENTLENGTH) && request->http11;
+    if (body && !(parser->flags & F_CONTENTLENGTH) && !request->http11)
+        request->keep_alive = false;
+    request->status = parser->status_code;
+
+    /* the head is copied unframed, whatever the body then needs */
+    *stream = (struct http_stream){.conn = request->conn};
+    if (status[status_len - 1] == '\r')
+        status_len--;
+    ret = http_stream_lit(stream, "HTTP/1.1");
+    if (!ret)
+        ret = http_stream_write(stream, status, status_len);
+    if (!ret)
+        ret = http_stream_lit(stream, CRLF);
+    if (!ret)
+        ret = http_proxy_headers(lines, head + len - lines,
+                                 proxy_response_drop, http_proxy_stream_line,
+                                 stream);
+    /* a head the backend got wrong is its failure, not the client's */
+    if (ret == -EBADMSG)
+        ret = -EPROTO;
+    if (ret >= 0 && chunked)
+        ret = http_stream_lit(stream, "Transfer-Encoding: chunked" CRLF);
+    if (ret >= 0) {
+        p = http_stream_space(stream, HTTP_HEAD_END_MAX);
+        if (IS_ERR(p)) {
+            ret = PTR_ERR(p);
+        } else {
+            stream->len += http_put_head_end(p, request->keep_alive) - p;
+            ret = http_stream_close(stream);
+        }
+    }
+    resp->sent = true;
+    if (ret < 0) {
+        resp->error = ret;
+        return -1;
+    }
+    stream->chunked = chunked;
+    stream->discard = !body;
+    /* whatever the response says, one to HEAD has no body */
+    return request->method == HTTP_HEAD;
+}
+
+static int http_proxy_on_body(http_parser *parser, const char *p, size_t len)
 {
-    struct kvec iov = {.iov_base = (void *) buf, .iov_len = size};
-    struct msghdr msg = {
-        .msg_name = 0,
-        .msg_namelen = 0,
-        .msg_control = NULL,
-        .msg_controllen = 0,
-        .msg_flags = 0,
-    };
-    return kernel_recvmsg(sock, &msg, &iov, 1, size, msg.msg_flags);
+    struct http_proxy_response *resp = parser->data;
+    int ret = http_stream_write(&resp->stream, p, len);
+
+    if (ret < 0) {
+        resp->error = ret;
+        return -1;
+    }
+    return 0;
 }
 
-static int http_server_send(struct socket *sock, const char *buf, size_t size)
+static int http_proxy_on_message_complete(http_parser *parser)
 {
-    struct msghdr msg = {
-        .msg_name = NULL,
-        .msg_namelen = 0,
-        .msg_control = NULL,
-        .msg_controllen = 0,
-        .msg_flags = 0,
-    };
-    int done = 0;
-    while (done < size) {
-        struct kvec iov = {
-            .iov_base = (void *) ((char *) buf + done),
-            .iov_len = size - done,
-        };
-        int length = kernel_sendmsg(sock, &msg, &iov, 1, iov.iov_len);
-        if (length < 0) {
-            pr_err("write error: %d\n", length);
+    struct http_proxy_response *resp = parser->data;
+
+    if (parser->status_code < 200)
+        return 0;
+    resp->done = true;
+    /* anything after the response would be unasked for */
+    http_parser_pause(parser, 1);
+    return 0;
+}
+
+static const struct http_parser_settings proxy_settings = {
+    .on_headers_complete = http_proxy_on_headers_complete,
+    .on_body = http_proxy_on_body,
+    .on_message_complete = http_proxy_on_message_complete,
+};
+
+/* Read the response to the forwarded request and pass it on */
+static int http_proxy_relay(struct http_proxy_response *resp)
+{
+    struct http_upstream *up = resp->request->proxy.upstream;
+    struct http_parser parser;
+
+    http_parser_init(&parser, HTTP_RESPONSE);
+    parser.data = resp;
+    while (!resp->done) {
+        /* until the head is complete, reads are appended to it */
+        size_t off = resp->sent ? 0 : resp->len, n;
+        int ret;
+
+        if (off == HTTP_UPSTREAM_BUF_SIZE)
+            return -EMSGSIZE;
+        ret = http_upstream_recv(up, up->buf + off,
+                                 HTTP_UPSTREAM_BUF_SIZE - off);
+        if (ret < 0)
+            return ret;
+        resp->len = off + ret;
+        /* no bytes is the end of the stream, which may end the body */
+        n = http_parser_execute(&parser, &proxy_settings, up->buf + off, ret);
+        if (resp->error)
+            return resp->error;
+        if (HTTP_PARSER_ERRNO(&parser) == HPE_PAUSED) {
+            resp->reuse = n == ret && http_should_keep_alive(&parser);
             break;
         }
-        done += length;
+        if (HTTP_PARSER_ERRNO(&parser) != HPE_OK || n != ret)
+            return -EPROTO;
+        if (!ret)
+            return -EPIPE;
+        /* pass on what came before waiting on the backend again, so that
+         * a slow or streaming one reaches the client as it goes
+         */
+        if (resp->sent) {
+            ret = http_stream_close(&resp->stream);
+            if (!ret)
+                ret = http_batch_flush(resp->request->conn, 0);
+            if (ret < 0)
+                return ret;
+        }
     }
-    return done;
+    return 0;
+}
+
+/* End a chunked request body, empty or not */
+static int http_proxy_end_body(struct http_proxy *proxy)
+{
+    struct kvec vec = {.iov_base = "0" CRLF CRLF, .iov_len = 5};
+
+    if (!proxy->chunked)
+        return 0;
+    return http_upstream_send(proxy->upstream, &vec, 1, vec.iov_len);
+}
+
+/* Whether @method can reach the backend twice without harm. Bodies are not
+ * kept for another go, so methods that take one are never repeated.
+ */
+static bool http_proxy_can_retry(enum http_method method)
+{
+    return method == HTTP_GET || method == HTTP_HEAD ||
+           method == HTTP_OPTIONS || method == HTTP_TRACE;
+}
+
+/* Answer a forwarded request with the backend's response, or with 502 or
+ * 504 if there is none, or 400 if its head could not be passed on
+ */
+static int http_proxy_response(struct http_request *request, int keep_alive)
+{
+    struct http_proxy *proxy = &request->proxy;
+    struct http_proxy_response resp = {.request = request};
+    enum http_status status;
+    int ret = proxy->error;
+
+    if (!ret)
+        ret = http_proxy_end_body(proxy);
+    if (!ret)
+        ret = http_proxy_relay(&resp);
+    /* a pooled connection closed by the backend just as it was taken: a
+     * request safe to repeat, with nothing of it sent but the head and
+     * nothing back, goes once more on a new connection
+     */
+    if (ret && ret != -ETIMEDOUT && !resp.sent && !resp.len &&
+        !proxy->body && proxy->upstream && proxy->upstream->reused &&
+        http_proxy_can_retry(request->method)) {
+        http_upstream_put(proxy->upstream, false);
+        proxy->upstream = NULL;
+        resp = (struct http_proxy_response){.request = request};
+        ret = http_proxy_send_head(proxy, true);
+        if (!ret)
+            ret = http_proxy_end_body(proxy);
+        if (!ret)
+            ret = http_proxy_relay(&resp);
+    }
+    if (!ret) {
+        ret = http_stream_end(&resp.stream);
+        http_upstream_put(proxy->upstream, resp.reuse);
+        proxy->upstream = NULL;
+        return ret;
+    }
+    pr_debug("backend failure, err=%d\n", ret);
+    /* too late for an error status: the response is cut short */
+    if (resp.sent)
+        return ret;
+    if (ret == -EBADMSG)
+        status = HTTP_STATUS_BAD_REQUEST;
+    else if (ret == -ETIMEDOUT)
+        status = HTTP_STATUS_GATEWAY_TIMEOUT;
+    else
+        status = HTTP_STATUS_BAD_GATEWAY;
+    return http_server_send_status(request, status, keep_alive);
+}
+
+/* Forward a complete GET or HEAD that khttpd has nothing for */
+static int http_proxy_forward(struct http_request *request, int keep_alive)
+{
+    http_proxy_begin(request, false, proxy_request_drop_body);
+    return http_proxy_response(request, keep_alive);
 }
 
 static int http_server_response(struct http_request *request, int keep_alive)
 {
-    char *response;
+    enum http_encoding encoding;
+    struct http_cache_entry *entry;
+    struct file *filp;
+    bool index;
+    int ret;
+
+    if (request->proxy.active)
+        return http_proxy_response(request, keep_alive);
+
+    ret = http_route_dispatch(request, request->method,
+                              request->slices[HTTP_SLICE_URL].p,
+                              http_request_path_len(request));
+    if (ret <= 0) {
+        /* the handler returned without answering */
+        if (!ret && !request->status)
+            ret = http_server_send_status(
+                request, HTTP_STATUS_INTERNAL_SERVER_ERROR, keep_alive);
+        return ret;
+    }
+
+    if (!http_file_enabled()) {
+        if (http_proxy_enabled())
+            return http_proxy_forward(request, keep_alive);
+        if (request->method == HTTP_GET)
+            return http_server_send_hello(request, keep_alive);
+        return http_server_send_status(request, HTTP_STATUS_NOT_IMPLEMENTED,
+                                       keep_alive);
+    }
+
+    if (request->method != HTTP_GET && request->method != HTTP_HEAD)
+        return http_server_send_status(request, HTTP_STATUS_NOT_IMPLEMENTED,
+                                       keep_alive);
+
+    encoding = http_accept_encoding(
+        http_request_str(request, HTTP_HEADER_ACCEPT_ENCODING));
+    entry = http_cache_lookup(http_request_str(request, HTTP_HEADER_HOST),
+                              http_request_str(request, HTTP_SLICE_URL),
+                              encoding);
+    if (entry) {
+        /* revalidation never needs more than the entry's metadata */
+        if (http_request_not_modified(request, &entry->validator)) {
+            ret = http_server_send_not_modified(request, &entry->validator,
+                                                entry->vary, keep_alive);
+            http_cache_put(entry);
+            return ret;
+        }
+        return http_server_send_cached(request, entry, keep_alive);
+    }
 
-    pr_info("requested_url = %s\n", request->request_url);
-    if (request->method != HTTP_GET)
-        response = keep_alive ? HTTP_RESPONSE_501_KEEPALIVE : HTTP_RESPONSE_501;
+    /* URLs too long for a path are answered with 414 */
+    filp = http_file_open(http_request_str(request, HTTP_SLICE_URL), &index);
+    if ((filp == ERR_PTR(-ENOENT) || filp == ERR_PTR(-ENOTDIR)) &&
+        http_proxy_enabled())
+        return http_proxy_forward(request, keep_alive);
+    if (IS_ERR(filp))
+        return http_server_send_status(
+            request, http_status_from_errno(PTR_ERR(filp)), keep_alive);
+    if (S_ISDIR(file_inode(filp)->i_mode))
+        ret = http_server_send_listing(request, filp);
     else
-        response = keep_alive ? HTTP_RESPONSE_200_KEEPALIVE_DUMMY
-                              : HTTP_RESPONSE_200_DUMMY;
-    http_server_send(request->socket, response, strlen(response));
-    return 0;
+        ret = http_server_send_file(request, filp, index, encoding,
+                                    keep_alive);
+    filp_close(filp, NULL);
+    return ret;
 }
 
-static int http_parser_callback_message_begin(http_parser *parser)
+/* Add the @len bytes at @p to token @id. The input buffer keeps a request
+ * whole, so the pieces of a token are adjacent, except for a header value
+ * folded over several lines. Returns false for those.
+ */
+static bool http_request_append(struct http_request *request,
+                                int id,
+                                const char *p,
+                                size_t len)
 {
-    struct http_request *request = parser->data;
-    struct socket *socket = request->socket;
+    struct http_slice *slice = &request->slices[id];
+
+    if (!slice->len)
+        slice->p = (char *) p;
+    else if (p != slice->p + slice->len)
+        return false;
+    slice->len += len;
+    return true;
+}
+
+/* Retarget the tokens in the @len bytes at @from, which moved to @to */
+static void http_request_move(struct http_request *request,
+                              const char *from,
+                              char *to,
+                              size_t len)
+{
+    for (int i = 0; i < NR_HTTP_SLICES; i++) {
+        struct http_slice *slice = &request->slices[i];
+        if (slice->len && slice->p >= from && slice->p < from + len)
+            slice->p = to + (slice->p - from);
+    }
+}
+
+/* Start a request; fails if the client is over its rate */
+static int http_request_begin(struct http_request *request)
+{
+    struct http_conn *conn = request->conn;
+    unsigned int timeout;
     memset(request, 0x00, sizeof(struct http_request));
-    request->socket = socket;
+    request->conn = conn;
+    if (!http_limit_request((struct sockaddr *) &conn->peer)) {
+        /* refuse before parsing anything, then drop the connection */
+        request->status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+        http_stats_inc(HTTP_STAT_SHED);
+        http_stats_status(request->status);
+        http_batch_ref(conn, HTTP_RESPONSE_503, strlen(HTTP_RESPONSE_503));
+        return -1;
+    }
+    request->start = ktime_get_ns();
+    request->output_before = http_conn_output(conn);
+    request->begin = jiffies;
+    /* headers must arrive by whichever limit comes first */
+    timeout = header_timeout;
+    if (!timeout || (request_timeout && request_timeout < timeout))
+        timeout = request_timeout;
+    http_conn_set_deadline(conn, request->begin, timeout);
+    trace_khttpd_request_begin(conn->id);
     return 0;
 }
 
+/* Whether the general parser is in the middle of a request */
+static bool http_request_pending(const struct http_request *request)
+{
+    return request->start && !request->complete;
+}
+
+static void http_request_headers(struct http_request *request,
+                                 enum http_method method,
+                                 bool http11,
+                                 bool keep_alive)
+{
+    struct http_slice *url = &request->slices[HTTP_SLICE_URL];
+    char *query;
+
+    /* the parser has moved past the delimiter behind every token */
+    http_request_terminate(request);
+    query = url->len ? memchr(url->p, '?', url->len) : NULL;
+    if (query) {
+        request->slices[HTTP_SLICE_QUERY].p = query + 1;
+        request->slices[HTTP_SLICE_QUERY].len = url->p + url->len - query - 1;
+    }
+    request->method = method;
+    request->http11 = http11;
+    request->keep_alive = keep_alive;
+    request->parsed = ktime_get_ns();
+    http_conn_set_deadline(request->conn, request->begin, request_timeout);
+    trace_khttpd_headers_complete(request->conn->id, request->method,
+                                  http_request_str(request, HTTP_SLICE_URL));
+}
+
+static int http_request_complete(struct http_request *request)
+{
+    struct http_conn *conn = request->conn;
+    int ret = http_server_response(request, request->keep_alive);
+    conn->requests++;
+    trace_khttpd_response_sent(conn->id,
+                               http_request_str(request, HTTP_SLICE_URL),
+                               request->status,
+                               http_conn_output(conn) - request->output_before);
+    http_stats_inc(HTTP_STAT_REQUESTS);
+    http_stats_status(request->status);
+    http_stats_latency(ktime_get_ns() - request->parsed);
+    access_log_add((struct sockaddr *) &conn->peer, request->method,
+                   http_request_str(request, HTTP_SLICE_URL), request->status,
+                   http_conn_output(conn) - request->output_before,
+                   request->start);
+    http_proxy_release(&request->proxy);
+    request->complete = 1;
+    http_conn_set_deadline(conn, jiffies, idle_timeout);
+    /* a response cut short leaves the connection unusable */
+    return ret < 0 ? -1 : 0;
+}
+
+static int http_parser_callback_message_begin(http_parser *parser)
+{
+    return http_request_begin(parser->data);
+}
+
 static int http_parser_callback_request_url(http_parser *parser,
                                             const char *p,
                                             size_t len)
 {
     struct http_request *request = parser->data;
-    strncat(request->request_url, p, len);
+    http_request_append(request, HTTP_SLICE_URL, p, len);
     return 0;
 }
 
@@ -112,6 +2052,14 @@ static int http_parser_callback_header_field(http_parser *parser,
                                              const char *p,
                                              size_t len)
 {
+    struct http_request *request = parser->data;
+
+    /* a field name may arrive in pieces; a new one starts after a value */
+    if (request->in_header_value) {
+        request->in_header_value = false;
+        request->slices[HTTP_SLICE_FIELD].len = 0;
+    }
+    http_request_append(request, HTTP_SLICE_FIELD, p, len);
     return 0;
 }
 
@@ -119,13 +2067,42 @@ static int http_parser_callback_header_value(http_parser *parser,
                                              const char *p,
                                              size_t len)
 {
+    struct http_request *request = parser->data;
+
+    if (!request->in_header_value) {
+        struct http_slice *field = &request->slices[HTTP_SLICE_FIELD];
+
+        request->in_header_value = true;
+        request->header = http_header_lookup(field->p, field->len);
+        /* the first of repeated headers wins */
+        if (request->header >= 0 && request->slices[request->header].len)
+            request->header = -1;
+    }
+    /* obsolete line folding may be refused (RFC 7230, section 3.2.4) */
+    if (request->header >= 0 &&
+        !http_request_append(request, request->header, p, len)) {
+        http_stats_status(HTTP_STATUS_BAD_REQUEST);
+        http_server_send_status(request, HTTP_STATUS_BAD_REQUEST, 0);
+        return -1;
+    }
     return 0;
 }
 
 static int http_parser_callback_headers_complete(http_parser *parser)
 {
     struct http_request *request = parser->data;
-    request->method = parser->method;
+
+    http_request_headers(
+        request, parser->method,
+        parser->http_major > 1 ||
+            (parser->http_major == 1 && parser->http_minor >= 1),
+        http_should_keep_alive(parser));
+    /* only the backend takes bodies, so they go to it as they arrive */
+    if (http_proxy_enabled() && request->method != HTTP_GET &&
+        request->method != HTTP_HEAD &&
+        !http_route_match(request->method, request->slices[HTTP_SLICE_URL].p,
+                          http_request_path_len(request)))
+        http_proxy_start(request, parser->flags & F_CHUNKED);
     return 0;
 }
 
@@ -133,74 +2110,523 @@ static int http_parser_callback_body(http_parser *parser,
                                      const char *p,
                                      size_t len)
 {
+    struct http_request *request = parser->data;
+
+    if (request->proxy.active)
+        http_proxy_body(request, p, len);
     return 0;
 }
 
 static int http_parser_callback_message_complete(http_parser *parser)
 {
-    struct http_request *request = parser->data;
-    http_server_response(request, http_should_keep_alive(parser));
-    request->complete = 1;
+    if (http_request_complete(parser->data) < 0)
+        return -1;
+    /* give the next request in the buffer to the fast path */
+    http_parser_pause(parser, 1);
     return 0;
 }
 
-static int http_server_worker(void *arg)
+static const struct http_parser_settings parser_settings = {
+    .on_message_begin = http_parser_callback_message_begin,
+    .on_url = http_parser_callback_request_url,
+    .on_header_field = http_parser_callback_header_field,
+    .on_header_value = http_parser_callback_header_value,
+    .on_headers_complete = http_parser_callback_headers_complete,
+    .on_body = http_parser_callback_body,
+    .on_message_complete = http_parser_callback_message_complete,
+};
+
+/* Answer a request whose head http_fast_parse() took in one go */
+static int http_request_fast(struct http_request *request,
+                             const struct http_fast_request *fast)
 {
-    char *buf;
-    struct http_parser parser;
-    struct http_parser_settings setting = {
-        .on_message_begin = http_parser_callback_message_begin,
-        .on_url = http_parser_callback_request_url,
-        .on_header_field = http_parser_callback_header_field,
-        .on_header_value = http_parser_callback_header_value,
-        .on_headers_complete = http_parser_callback_headers_complete,
-        .on_body = http_parser_callback_body,
-        .on_message_complete = http_parser_callback_message_complete,
-    };
-    struct http_request request;
-    struct socket *socket = (struct socket *) arg;
-    int err = 0;
+    if (http_request_begin(request) < 0)
+        return -1;
+    http_stats_inc(HTTP_STAT_FAST_PARSED);
+    memcpy(request->slices, fast->headers, sizeof(fast->headers));
+    request->slices[HTTP_SLICE_URL] = fast->url;
+    http_request_headers(request, fast->method, fast->http11,
+                         fast->keep_alive);
+    return http_request_complete(request);
+}
 
-    allow_signal(SIGKILL);
-    allow_signal(SIGTERM);
+/* Parse and answer the @len bytes just received at @p. A request starting
+ * with its whole head at hand takes the fast path; http_parser gets the
+ * rest and pauses after each request so that the next can take it too.
+ */
+static int http_conn_parse(struct http_conn *conn, char *p, size_t len)
+{
+    struct http_parser *parser = &conn->parser;
+    struct http_request *request = &conn->request;
+
+    while (len) {
+        size_t n;
+
+        if (fast_parse && !http_request_pending(request)) {
+            struct http_fast_request fast;
+            int ret = http_fast_parse(p, len, &fast);
+
+            if (ret > 0) {
+                if (http_request_fast(request, &fast) < 0)
+                    return -1;
+                p += ret;
+                len -= ret;
+                if (!request->keep_alive)
+                    return 0;
+                continue;
+            }
+        }
+
+        n = http_parser_execute(parser, &parser_settings, p, len);
+        if (HTTP_PARSER_ERRNO(parser) == HPE_PAUSED)
+            http_parser_pause(parser, 0);
+        else if (HTTP_PARSER_ERRNO(parser) != HPE_OK || n < len)
+            return -1; /* also upgrades, which are not supported */
+        p += n;
+        len -= n;
+        if (request->complete && !request->keep_alive)
+            return 0;
+    }
+    return 0;
+}
+
+static void http_conn_put_input(struct http_conn *conn)
+{
+    if (conn->in_size == RECV_BUFFER_SIZE)
+        http_buf_put(conn->in);
+    else
+        kvfree(conn->in);
+    conn->in = NULL;
+    conn->in_size = 0;
+    conn->in_len = 0;
+}
+
+/* Pack the tokens of a request past its headers, NUL-terminated by then,
+ * at @to, the start of the input buffer, in the order they are in. Returns
+ * the bytes they take.
+ */
+static size_t http_request_compact(struct http_request *request, char *to)
+{
+    struct http_slice *url = &request->slices[HTTP_SLICE_URL];
+    struct http_slice *query = &request->slices[HTTP_SLICE_QUERY];
+    size_t query_off = query->p ? query->p - url->p : 0;
+    char *p = to;
+
+    for (;;) {
+        struct http_slice *next = NULL;
+
+        /* tokens not moved yet are all at or behind @p */
+        for (int i = 0; i < NR_HTTP_SLICES; i++) {
+            struct http_slice *slice = &request->slices[i];
+
+            if (slice->len && i != HTTP_SLICE_QUERY && slice->p >= p &&
+                (!next || slice->p < next->p))
+                next = slice;
+        }
+        if (!next)
+            break;
+        memmove(p, next->p, next->len + 1);
+        next->p = p;
+        p += next->len + 1;
+    }
+    if (query->p)
+        query->p = url->p + query_off;
+    return p - to;
+}
+
+/* Make room in a full input buffer. Parsed bytes in front of the first
+ * token of the pending request are dropped; once its headers are parsed,
+ * its tokens are packed and the body bytes between and behind them, which
+ * the parser has consumed, are dropped too. Only if that frees nothing is
+ * the buffer grown, up to max_header_size.
+ */
+static int http_conn_input_room(struct http_conn *conn)
+{
+    struct http_request *request = &conn->request;
+    size_t keep = conn->in_len, len, limit, size;
+    char *in;
+
+    /* the whole buffer has been through the parser */
+    if (http_request_pending(request) && request->parsed &&
+        !request->proxy.active) {
+        len = http_request_compact(request, conn->in);
+        if (len < conn->in_len) {
+            conn->in_len = len;
+            return 0;
+        }
+    }
+
+    /* a forwarded request has nothing left in the buffer but its body */
+    for (int i = 0; i < NR_HTTP_SLICES && !request->proxy.active; i++) {
+        if (request->slices[i].len)
+            keep = min_t(size_t, keep, request->slices[i].p - conn->in);
+    }
+    if (keep) {
+        http_request_move(request, conn->in + keep, conn->in,
+                          conn->in_len - keep);
+        memmove(conn->in, conn->in + keep, conn->in_len - keep);
+        conn->in_len -= keep;
+        return 0;
+    }
+
+    limit = max_t(size_t, READ_ONCE(max_header_size), RECV_BUFFER_SIZE);
+    if (conn->in_size >= limit)
+        return -EMSGSIZE;
+    size = min(2 * conn->in_size, limit);
+    in = kvmalloc(size, GFP_KERNEL);
+    if (!in) {
+        http_stats_inc(HTTP_STAT_ALLOC_FAILURES);
+        return -ENOMEM;
+    }
+    http_stats_inc(HTTP_STAT_BUF_ALLOCS);
+    memcpy(in, conn->in, conn->in_len);
+    http_request_move(request, conn->in, in, conn->in_len);
+    len = conn->in_len;
+    http_conn_put_input(conn);
+    conn->in = in;
+    conn->in_size = size;
+    conn->in_len = len;
+    return 0;
+}
+
+static void http_conn_release(struct kref *ref)
+{
+    kmem_cache_free(http_conn_cache, container_of(ref, struct http_conn, ref));
+}
+
+static void http_conn_queue(struct http_conn *conn, int cpu)
+{
+    /* the pending work item owns a reference until it has run */
+    kref_get(&conn->ref);
+    if (!queue_work_on(cpu, khttpd_wq, &conn->work))
+        kref_put(&conn->ref, http_conn_release);
+}
+
+/* Runs in softirq context, where the socket can't be released, so it only
+ * hands an expired connection to its worker.
+ */
+static void http_conn_timeout(struct timer_list *timer)
+{
+    struct http_conn *conn = container_of(timer, struct http_conn, timer);
+    unsigned long deadline = READ_ONCE(conn->deadline);
 
-    buf = mempool_alloc(http_buf_pool, GFP_KERNEL);
-    if (!buf) {
-        pr_err("can't allocate memory!\n");
-        err = -ENOMEM;
+    if (!deadline)
+        return;
+    if (time_before(jiffies, deadline)) {
+        timer_reduce(&conn->timer, deadline);
+        return;
+    }
+    wake_up(&conn->wait);
+    http_conn_queue(conn, WORK_CPU_UNBOUND);
+}
+
+static void http_conn_data_ready(struct sock *sk)
+{
+    struct http_conn *conn;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    conn = sk->sk_user_data;
+    if (conn)
+        http_conn_queue(conn, WORK_CPU_UNBOUND);
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void http_conn_write_space(struct sock *sk)
+{
+    struct http_conn *conn;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    conn = sk->sk_user_data;
+    if (conn && http_sock_writeable(sk))
+        wake_up(&conn->wait);
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void http_conn_state_change(struct sock *sk)
+{
+    struct http_conn *conn;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    conn = sk->sk_user_data;
+    if (conn) {
+        wake_up(&conn->wait);
+        http_conn_queue(conn, WORK_CPU_UNBOUND);
+    }
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void http_conn_attach(struct http_conn *conn)
+{
+    struct sock *sk = conn->socket->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    conn->saved_data_ready = sk->sk_data_ready;
+    conn->saved_write_space = sk->sk_write_space;
+    conn->saved_state_change = sk->sk_state_change;
+    sk->sk_user_data = conn;
+    sk->sk_data_ready = http_conn_data_ready;
+    sk->sk_write_space = http_conn_write_space;
+    sk->sk_state_change = http_conn_state_change;
+    write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/* Called from the connection's own work item, so it never runs twice */
+static void http_conn_close(struct http_conn *conn)
+{
+    struct socket *socket = conn->socket;
+    struct sock *sk = socket->sk;
+
+    /* once the callbacks are restored nothing can queue @conn again */
+    write_lock_bh(&sk->sk_callback_lock);
+    sk->sk_user_data = NULL;
+    sk->sk_data_ready = conn->saved_data_ready;
+    sk->sk_write_space = conn->saved_write_space;
+    sk->sk_state_change = conn->saved_state_change;
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    /* a cleared deadline keeps the timer from rearming itself */
+    WRITE_ONCE(conn->deadline, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    timer_delete_sync(&conn->timer);
+#else
+    del_timer_sync(&conn->timer);
+#endif
+
+    mutex_lock(&conn_lock);
+    list_del(&conn->node);
+    mutex_unlock(&conn_lock);
+
+    conn->closed = true;
+    trace_khttpd_close(conn->id, conn->requests, conn->sent);
+    http_stats_dec(HTTP_STAT_ACTIVE);
+    http_limit_conn_put((struct sockaddr *) &conn->peer);
+    http_proxy_release(&conn->request.proxy);
+    if (conn->in)
+        http_conn_put_input(conn);
+    kernel_sock_shutdown(socket, SHUT_RDWR);
+    sock_release(socket);
+    kref_put(&conn->ref, http_conn_release);
+}
+
+/* Drain whatever the socket has buffered without blocking, then go back to
+ * waiting for the next sk_data_ready().
+ */
+static void http_server_worker(struct work_struct *work)
+{
+    struct http_conn *conn = container_of(work, struct http_conn, work);
+    struct http_batch batch = {0};
+    bool close = false;
+
+    if (conn->closed)
+        goto out;
+    if (http_conn_expired(conn)) {
+        pr_debug("connection %llu timed out\n", conn->id);
+        http_stats_inc(HTTP_STAT_REAPED);
+        http_conn_close(conn);
         goto out;
     }
 
-    request.socket = socket;
-    http_parser_init(&parser, HTTP_REQUEST);
-    parser.data = &request;
-    while (!kthread_should_stop()) {
-        int ret = http_server_recv(socket, buf, RECV_BUFFER_SIZE - 1);
+    if (!conn->in) {
+        conn->in = http_buf_get();
+        if (!conn->in) {
+            pr_err("can't allocate memory!\n");
+            http_conn_close(conn);
+            goto out;
+        }
+        conn->in_size = RECV_BUFFER_SIZE;
+    }
+
+    /* every request parsed from one read is answered by a single send */
+    conn->batch = &batch;
+    for (;;) {
+        struct http_request *request = &conn->request;
+        char *p;
+        int ret;
+
+        if (conn->in_len == conn->in_size) {
+            ret = http_conn_input_room(conn);
+            if (ret == -EMSGSIZE) {
+                /* only a body can outgrow the buffer past the headers */
+                enum http_status status =
+                    HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
+                if (request->parsed)
+                    status = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+                http_stats_status(status);
+                if (!http_server_send_status(request, status, 0))
+                    http_batch_flush(conn, 0);
+            }
+            if (ret < 0) {
+                close = true;
+                break;
+            }
+        }
+        p = conn->in + conn->in_len;
+        ret = http_server_recv(conn->socket, p, conn->in_size - conn->in_len);
+        if (ret == -EAGAIN)
+            break;
         if (ret <= 0) {
             if (ret) {
-                pr_err("recv error: %d\n", ret);
-                err = ret;
+                pr_debug("recv error: %d\n", ret);
+                http_stats_inc(HTTP_STAT_RECV_ERRORS);
             }
-            goto out_free_buf;
+            close = true;
+            break;
+        }
+        http_stats_add(HTTP_STAT_BYTES_IN, ret);
+        conn->in_len += ret;
+        ret = http_conn_parse(conn, p, ret);
+        if (http_batch_flush(conn, 0) < 0 || ret < 0 ||
+            (request->complete && !request->keep_alive)) {
+            close = true;
+            break;
         }
-        http_parser_execute(&parser, &setting, buf, ret);
-        if (request.complete && !http_should_keep_alive(&parser))
-            goto out_free_buf;
-        memset(buf, 0, RECV_BUFFER_SIZE);
+        /* nothing received so far is needed once its requests are answered */
+        if (request->complete)
+            conn->in_len = 0;
     }
-out_free_buf:
-    mempool_free(buf, http_buf_pool);
+    conn->batch = NULL;
+    if (batch.scratch)
+        http_buf_put(batch.scratch);
+    if (close)
+        http_conn_close(conn);
+    else if (!conn->in_len)
+        http_conn_put_input(conn);
 out:
-    kernel_sock_shutdown(socket, SHUT_RDWR);
-    sock_release(socket);
-    return err;
+    kref_put(&conn->ref, http_conn_release);
+}
+
+/* A refused connection lingering after its 503, whose request is read and
+ * dropped until the client closes: closing with unread bytes would reset
+ * the connection, and the client would likely never see the response.
+ */
+struct http_shed {
+    struct socket *socket;
+    struct delayed_work work;
+    struct list_head node;
+    unsigned long deadline;
+};
+
+static LIST_HEAD(shed_list);
+static DEFINE_SPINLOCK(shed_lock);
+static unsigned int shed_lingering;
+
+static void http_shed_release(struct http_shed *shed)
+{
+    sock_release(shed->socket);
+    kfree(shed);
+}
+
+static void http_shed_linger(struct work_struct *work)
+{
+    struct http_shed *shed =
+        container_of(to_delayed_work(work), struct http_shed, work);
+    char buf[256];
+    int ret;
+
+    do {
+        ret = http_server_recv(shed->socket, buf, sizeof(buf));
+    } while (ret > 0);
+    if (ret == -EAGAIN && time_before(jiffies, shed->deadline)) {
+        queue_delayed_work(khttpd_wq, &shed->work, SHED_LINGER_POLL);
+        return;
+    }
+    /* whoever takes it off the list releases it */
+    spin_lock(&shed_lock);
+    if (list_empty(&shed->node)) {
+        spin_unlock(&shed_lock);
+        return;
+    }
+    list_del_init(&shed->node);
+    shed_lingering--;
+    spin_unlock(&shed_lock);
+    http_shed_release(shed);
+}
+
+/* Shut down every live connection and wait for its worker to close it */
+void http_server_close_conns(void)
+{
+    struct http_conn *conn;
+
+    for (;;) {
+        mutex_lock(&conn_lock);
+        if (list_empty(&conn_list)) {
+            mutex_unlock(&conn_lock);
+            break;
+        }
+        list_for_each_entry (conn, &conn_list, node) {
+            kernel_sock_shutdown(conn->socket, SHUT_RDWR);
+            http_conn_queue(conn, WORK_CPU_UNBOUND);
+        }
+        mutex_unlock(&conn_lock);
+        flush_workqueue(khttpd_wq);
+    }
+
+    /* refused connections still lingering go without waiting */
+    for (;;) {
+        struct http_shed *shed;
+
+        spin_lock(&shed_lock);
+        shed = list_first_entry_or_null(&shed_list, struct http_shed, node);
+        if (shed) {
+            list_del_init(&shed->node);
+            shed_lingering--;
+        }
+        spin_unlock(&shed_lock);
+        if (!shed)
+            break;
+        cancel_delayed_work_sync(&shed->work);
+        http_shed_release(shed);
+    }
+}
+
+/* Answer an over-limit client without allocating or parsing anything. The
+ * response fits any fresh socket buffer, so the send never waits.
+ */
+static void http_server_shed(struct socket *socket)
+{
+    static const char response[] = HTTP_RESPONSE_503;
+    struct kvec vec = {
+        .iov_base = (void *) response,
+        .iov_len = sizeof(response) - 1,
+    };
+    struct msghdr msg = {.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL};
+    struct http_shed *shed;
+
+    kernel_sendmsg(socket, &msg, &vec, 1, vec.iov_len);
+    http_stats_inc(HTTP_STAT_SHED);
+    http_stats_status(HTTP_STATUS_SERVICE_UNAVAILABLE);
+    kernel_sock_shutdown(socket, SHUT_WR);
+
+    /* past the cap, a flood of refusals ends in resets instead */
+    shed = kmalloc(sizeof(*shed), GFP_KERNEL | __GFP_NOWARN);
+    if (shed) {
+        shed->socket = socket;
+        shed->deadline = jiffies + SHED_LINGER_TIME;
+        INIT_DELAYED_WORK(&shed->work, http_shed_linger);
+    }
+    spin_lock(&shed_lock);
+    if (shed && shed_lingering < SHED_LINGER_MAX) {
+        shed_lingering++;
+        list_add(&shed->node, &shed_list);
+    } else {
+        kfree(shed);
+        shed = NULL;
+    }
+    spin_unlock(&shed_lock);
+    if (!shed) {
+        sock_release(socket);
+        return;
+    }
+    queue_delayed_work(khttpd_wq, &shed->work, SHED_LINGER_POLL);
 }
 
 int http_server_daemon(void *arg)
 {
     struct socket *socket;
-    struct task_struct *worker;
+    struct http_conn *conn;
+    struct sockaddr_in6 peer; /* large enough for IPv4 peers too */
     struct http_server_param *param = (struct http_server_param *) arg;
+    int cpu = -1;
 
     allow_signal(SIGKILL);
     allow_signal(SIGTERM);
@@ -213,13 +2639,88 @@ int http_server_daemon(void *arg)
             pr_err("kernel_accept() error: %d\n", err);
             continue;
         }
-        worker = kthread_run(http_server_worker, socket, KBUILD_MODNAME);
-        if (IS_ERR(worker)) {
-            pr_err("can't create more worker process\n");
+        http_stats_inc(HTTP_STAT_ACCEPTED);
+        /* a Unix peer's address says nothing, and might not even fit */
+        if (socket->sk->sk_family == AF_UNIX)
+            peer.sin6_family = AF_UNIX;
+        else if (kernel_getpeername(socket, (struct sockaddr *) &peer) < 0)
+            peer.sin6_family = AF_UNSPEC;
+        if (!http_limit_conn_get((struct sockaddr *) &peer)) {
+            http_server_shed(socket);
+            continue;
+        }
+
+        /* per-CPU listeners keep the connection on their own CPU, the
+         * shared one spreads connections over the per-CPU worker pools.
+         * Later wakeups run on the CPU that received the packet.
+         */
+        if (param->cpu >= 0) {
+            cpu = param->cpu;
+        } else {
+            cpu = cpumask_next(cpu, cpu_online_mask);
+            if (cpu >= nr_cpu_ids)
+                cpu = cpumask_first(cpu_online_mask);
+        }
+        /* allocate on the node of the CPU that will serve it */
+        conn = kmem_cache_alloc_node(http_conn_cache, GFP_KERNEL | __GFP_ZERO,
+                                     cpu_to_node(cpu));
+        if (!conn) {
+            pr_err("can't allocate connection\n");
+            http_stats_inc(HTTP_STAT_ALLOC_FAILURES);
+            http_limit_conn_put((struct sockaddr *) &peer);
             kernel_sock_shutdown(socket, SHUT_RDWR);
             sock_release(socket);
             continue;
         }
+        http_stats_inc(HTTP_STAT_CONN_ALLOCS);
+        conn->socket = socket;
+        conn->peer = peer;
+        INIT_WORK(&conn->work, http_server_worker);
+        kref_init(&conn->ref);
+        init_waitqueue_head(&conn->wait);
+        timer_setup(&conn->timer, http_conn_timeout, 0);
+        http_parser_init(&conn->parser, HTTP_REQUEST);
+        conn->parser.data = &conn->request;
+        conn->request.conn = conn;
+        mutex_lock(&conn_lock);
+        list_add(&conn->node, &conn_list);
+        mutex_unlock(&conn_lock);
+        conn->id = atomic64_inc_return(&conn_ids);
+        trace_khttpd_accept(conn->id, (struct sockaddr *) &conn->peer);
+        http_stats_inc(HTTP_STAT_ACTIVE);
+        http_conn_set_deadline(conn, jiffies, idle_timeout);
+        http_conn_attach(conn);
+        /* pick up anything that arrived before the callbacks were set */
+        http_conn_queue(conn, cpu);
     }
     return 0;
 }
+
+int http_server_init(void)
+{
+    http_conn_cache = KMEM_CACHE(http_conn, SLAB_HWCACHE_ALIGN);
+    if (!http_conn_cache)
+        return -ENOMEM;
+    http_buf_cache = kmem_cache_create(KBUILD_MODNAME "_buf", RECV_BUFFER_SIZE,
+                                       0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!http_buf_cache)
+        goto err_conn_cache;
+    http_buf_pool = mempool_create_slab_pool(POOL_MIN_NR, http_buf_cache);
+    if (!http_buf_pool)
+        goto err_buf_cache;
+    return 0;
+
+err_buf_cache:
+    kmem_cache_destroy(http_buf_cache);
+err_conn_cache:
+    kmem_cache_destroy(http_conn_cache);
+    return -ENOMEM;
+}
+
+/* Called once every connection is closed and released */
+void http_server_exit(void)
+{
+    mempool_destroy(http_buf_pool);
+    kmem_cache_destroy(http_buf_cache);
+    kmem_cache_destroy(http_conn_cache);
+}
@@ -1,24 +1,19 @@
 #ifndef KHTTPD_HTTP_SERVER_H
 #define KHTTPD_HTTP_SERVER_H
 
+#include <linux/workqueue.h>
 #include <net/sock.h>
 
 #define RECV_BUFFER_SIZE 4096
-extern mempool_t *http_buf_pool;
+extern struct workqueue_struct *khttpd_wq;
 
 struct http_server_param {
     struct socket *listen_socket;
+    int cpu; /* CPU serving accepted connections, -1 to spread them */
 };
 
+extern int http_server_init(void);
+extern void http_server_exit(void);
 extern int http_server_daemon(void *arg);
-
-static inline void *http_buf_alloc(gfp_t gfp_mask, void *pool_data)
-{
-    return kzalloc(RECV_BUFFER_SIZE, gfp_mask);
-}
-
-static inline void http_buf_free(void *element, void *pool_data)
-{
-    kfree(element);
-}
+extern void http_server_close_conns(void);
 #endif
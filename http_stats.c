@@ -0,0 +1,70 @@
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+
+#include "http_stats.h"
+
+DEFINE_PER_CPU_ALIGNED(struct http_stats, http_stats);
+
+static const char *const http_stat_names[NR_HTTP_STATS] = {
+    [HTTP_STAT_ACCEPTED] = "accepted",
+    [HTTP_STAT_ACTIVE] = "active",
+    [HTTP_STAT_REQUESTS] = "requests",
+    [HTTP_STAT_FAST_PARSED] = "fast_parsed",
+    [HTTP_STAT_ROUTED] = "routed",
+    [HTTP_STAT_PROXIED] = "proxied",
+    [HTTP_STAT_BYTES_IN] = "bytes_in",
+    [HTTP_STAT_BYTES_OUT] = "bytes_out",
+    [HTTP_STAT_2XX] = "status_2xx",
+    [HTTP_STAT_3XX] = "status_3xx",
+    [HTTP_STAT_4XX] = "status_4xx",
+    [HTTP_STAT_5XX] = "status_5xx",
+    [HTTP_STAT_RECV_ERRORS] = "recv_errors",
+    [HTTP_STAT_SEND_ERRORS] = "send_errors",
+    [HTTP_STAT_REAPED] = "reaped",
+    [HTTP_STAT_SHED] = "shed",
+    [HTTP_STAT_CONN_ALLOCS] = "conn_allocs",
+    [HTTP_STAT_BUF_ALLOCS] = "buf_allocs",
+    [HTTP_STAT_ALLOC_FAILURES] = "alloc_failures",
+    [HTTP_STAT_COMPRESSED] = "compressed",
+    [HTTP_STAT_COMPRESS_IN] = "compress_in",
+    [HTTP_STAT_COMPRESS_OUT] = "compress_out",
+    [HTTP_STAT_UPSTREAM_CONNECTS] = "upstream_connects",
+};
+
+/* Writers only touch their own CPU's copy; readers pay for the summing */
+static int http_stats_show(struct seq_file *m, void *v)
+{
+    struct http_stats sum = {0};
+    int width = 0, cpu;
+
+    for_each_possible_cpu (cpu) {
+        const struct http_stats *stats = per_cpu_ptr(&http_stats, cpu);
+        for (int i = 0; i < NR_HTTP_STATS; i++)
+            sum.items[i] += READ_ONCE(stats->items[i]);
+        for (int i = 0; i < HTTP_LATENCY_BUCKETS; i++)
+            sum.latency[i] += READ_ONCE(stats->latency[i]);
+    }
+
+    /* line the values up after the longest name */
+    for (int i = 0; i < NR_HTTP_STATS; i++)
+        width = max_t(int, width, strlen(http_stat_names[i]));
+    for (int i = 0; i < NR_HTTP_STATS; i++)
+        seq_printf(m, "%-*s %lld\n", width, http_stat_names[i],
+                   (s64) sum.items[i]);
+    seq_printf(m, "%-*s count\n", width, "latency_us");
+    seq_printf(m, "%-*s %llu\n", width, "<1", sum.latency[0]);
+    for (int i = 1; i < HTTP_LATENCY_BUCKETS - 1; i++)
+        seq_printf(m, "<%-*llu %llu\n", width - 1, 1ULL << i, sum.latency[i]);
+    seq_printf(m, ">=%-*llu %llu\n", width - 2,
+               1ULL << (HTTP_LATENCY_BUCKETS - 2),
+               sum.latency[HTTP_LATENCY_BUCKETS - 1]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(http_stats);
+
+void http_stats_init(struct dentry *dir)
+{
+    debugfs_create_file("stats", 0444, dir, NULL, &http_stats_fops);
+}
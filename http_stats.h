@@ -0,0 +1,80 @@
+#ifndef KHTTPD_HTTP_STATS_H
+#define KHTTPD_HTTP_STATS_H
+
+#include <linux/bitops.h>
+#include <linux/dcache.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/time64.h>
+
+enum http_stat_item {
+    HTTP_STAT_ACCEPTED,
+    HTTP_STAT_ACTIVE, /* per-CPU values go negative, only the sum counts */
+    HTTP_STAT_REQUESTS,
+    HTTP_STAT_FAST_PARSED, /* requests whose head skipped http_parser */
+    HTTP_STAT_ROUTED,      /* requests answered by a registered route */
+    HTTP_STAT_PROXIED,     /* requests forwarded to the backend */
+    HTTP_STAT_BYTES_IN,
+    HTTP_STAT_BYTES_OUT,
+    HTTP_STAT_2XX,
+    HTTP_STAT_3XX,
+    HTTP_STAT_4XX,
+    HTTP_STAT_5XX,
+    HTTP_STAT_RECV_ERRORS,
+    HTTP_STAT_SEND_ERRORS,
+    HTTP_STAT_REAPED, /* closed for exceeding a timeout */
+    HTTP_STAT_SHED,   /* refused with 503 by admission control */
+    HTTP_STAT_CONN_ALLOCS,
+    HTTP_STAT_BUF_ALLOCS,
+    HTTP_STAT_ALLOC_FAILURES,
+    HTTP_STAT_COMPRESSED,        /* bodies compressed on the fly */
+    HTTP_STAT_COMPRESS_IN,       /* bytes fed to them */
+    HTTP_STAT_COMPRESS_OUT,      /* and what came out */
+    HTTP_STAT_UPSTREAM_CONNECTS, /* connections opened to the backend */
+    NR_HTTP_STATS,
+};
+
+/* Bucket i counts latencies in [2^(i-1), 2^i) microseconds, bucket 0 those
+ * under 1us, and the last one everything slower.
+ */
+#define HTTP_LATENCY_BUCKETS 24
+
+struct http_stats {
+    u64 items[NR_HTTP_STATS];
+    u64 latency[HTTP_LATENCY_BUCKETS];
+};
+
+DECLARE_PER_CPU_ALIGNED(struct http_stats, http_stats);
+
+static inline void http_stats_add(enum http_stat_item item, long delta)
+{
+    this_cpu_add(http_stats.items[item], delta);
+}
+
+static inline void http_stats_inc(enum http_stat_item item)
+{
+    this_cpu_inc(http_stats.items[item]);
+}
+
+static inline void http_stats_dec(enum http_stat_item item)
+{
+    this_cpu_dec(http_stats.items[item]);
+}
+
+static inline void http_stats_status(unsigned int status)
+{
+    if (status >= 200 && status < 600)
+        http_stats_inc(HTTP_STAT_2XX + status / 100 - 2);
+}
+
+static inline void http_stats_latency(u64 ns)
+{
+    unsigned int bucket = fls64(div_u64(ns, NSEC_PER_USEC));
+
+    if (bucket >= HTTP_LATENCY_BUCKETS)
+        bucket = HTTP_LATENCY_BUCKETS - 1;
+    this_cpu_inc(http_stats.latency[bucket]);
+}
+
+extern void http_stats_init(struct dentry *dir);
+#endif
@@ -0,0 +1,94 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM khttpd
+
+#if !defined(KHTTPD_HTTP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define KHTTPD_HTTP_TRACE_H
+
+#include <linux/in6.h>
+#include <linux/socket.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#ifndef KHTTPD_ASSIGN_STR
+#define KHTTPD_ASSIGN_STR
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define khttpd_assign_str(dst, src) __assign_str(dst)
+#else
+#define khttpd_assign_str(dst, src) __assign_str(dst, src)
+#endif
+#endif
+
+/* Request lifecycle of one connection, identified by @conn_id:
+ * accept -> (request_begin -> headers_complete -> response_sent)* -> close
+ */
+TRACE_EVENT(khttpd_accept,
+            TP_PROTO(u64 conn_id, const struct sockaddr *peer),
+            TP_ARGS(conn_id, peer),
+            TP_STRUCT__entry(__field(u64, conn_id) __array(
+                u8, peer, sizeof(struct sockaddr_in6))),
+            TP_fast_assign(__entry->conn_id = conn_id;
+                           memcpy(__entry->peer, peer,
+                                  sizeof(struct sockaddr_in6));),
+            TP_printk("conn=%llu peer=%pISpc",
+                      __entry->conn_id,
+                      __entry->peer));
+
+TRACE_EVENT(khttpd_request_begin,
+            TP_PROTO(u64 conn_id),
+            TP_ARGS(conn_id),
+            TP_STRUCT__entry(__field(u64, conn_id)),
+            TP_fast_assign(__entry->conn_id = conn_id;),
+            TP_printk("conn=%llu", __entry->conn_id));
+
+TRACE_EVENT(khttpd_headers_complete,
+            TP_PROTO(u64 conn_id, unsigned int method, const char *url),
+            TP_ARGS(conn_id, method, url),
+            TP_STRUCT__entry(__field(u64, conn_id) __field(unsigned int, method)
+                                 __string(url, url)),
+            TP_fast_assign(__entry->conn_id = conn_id;
+                           __entry->method = method;
+                           khttpd_assign_str(url, url);),
+            TP_printk("conn=%llu method=%u url=%s",
+                      __entry->conn_id,
+                      __entry->method,
+                      __get_str(url)));
+
+TRACE_EVENT(khttpd_response_sent,
+            TP_PROTO(u64 conn_id,
+                     const char *url,
+                     unsigned int status,
+                     u64 bytes),
+            TP_ARGS(conn_id, url, status, bytes),
+            TP_STRUCT__entry(__field(u64, conn_id) __string(url, url)
+                                 __field(unsigned int, status)
+                                     __field(u64, bytes)),
+            TP_fast_assign(__entry->conn_id = conn_id;
+                           khttpd_assign_str(url, url);
+                           __entry->status = status;
+                           __entry->bytes = bytes;),
+            TP_printk("conn=%llu url=%s status=%u bytes=%llu",
+                      __entry->conn_id,
+                      __get_str(url),
+                      __entry->status,
+                      __entry->bytes));
+
+TRACE_EVENT(khttpd_close,
+            TP_PROTO(u64 conn_id, u64 requests, u64 bytes),
+            TP_ARGS(conn_id, requests, bytes),
+            TP_STRUCT__entry(__field(u64, conn_id) __field(u64, requests)
+                                 __field(u64, bytes)),
+            TP_fast_assign(__entry->conn_id = conn_id;
+                           __entry->requests = requests;
+                           __entry->bytes = bytes;),
+            TP_printk("conn=%llu requests=%llu bytes=%llu",
+                      __entry->conn_id,
+                      __entry->requests,
+                      __entry->bytes));
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE http_trace
+#include <trace/define_trace.h>
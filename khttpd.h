@@ -0,0 +1,71 @@
+#ifndef KHTTPD_H
+#define KHTTPD_H
+
+/* Interface for other modules to serve requests from inside khttpd */
+
+#include <linux/bits.h>
+#include <linux/list.h>
+#include <linux/types.h>
+
+#include "http_fastparse.h"
+#include "http_parser.h"
+
+/* A methods mask for struct khttpd_route */
+#define KHTTPD_METHOD(m) BIT_ULL(m)
+
+struct http_request;
+
+/* Requests whose path is @prefix or continues it at a '/' go to @handler,
+ * before any file is looked up; "/api" takes "/api" and "/api/v1", not
+ * "/apis". The longest matching prefix wins. The handler runs in a worker
+ * and may sleep. It answers with khttpd_reply() or the khttpd_stream_*()
+ * calls and returns what they returned; a negative value closes the
+ * connection. Request bodies are not passed on.
+ */
+struct khttpd_route {
+    const char *prefix;
+    u64 methods; /* KHTTPD_METHOD()s, 0 for any */
+    int (*handler)(struct http_request *request, void *data);
+    void *data;
+    struct list_head node; /* private to khttpd */
+};
+
+/* The route and its prefix must stay valid until unregistered. Returns
+ * -EEXIST if a route for the same prefix takes one of its methods.
+ */
+extern int khttpd_route_register(struct khttpd_route *route);
+
+/* Returns once no handler call for @route is running any more */
+extern void khttpd_route_unregister(struct khttpd_route *route);
+
+extern enum http_method khttpd_request_method(
+    const struct http_request *request);
+
+/* The request target, query string included */
+extern const char *khttpd_request_url(const struct http_request *request);
+
+/* What follows '?' in the URL, "" if nothing does */
+extern const char *khttpd_request_query(const struct http_request *request);
+
+/* The value of a header khttpd keeps, "" if the request has none */
+extern const char *khttpd_request_header(const struct http_request *request,
+                                         enum http_header_id id);
+
+/* Answer with the @len bytes at @body, which are copied */
+extern int khttpd_reply(struct http_request *request,
+                        enum http_status status,
+                        const char *mime,
+                        const void *body,
+                        size_t len);
+
+/* Answer with a body of unknown length, written with khttpd_stream_write()
+ * and finished with khttpd_stream_end()
+ */
+extern int khttpd_stream_begin(struct http_request *request,
+                               enum http_status status,
+                               const char *mime);
+extern int khttpd_stream_write(struct http_request *request,
+                               const void *data,
+                               size_t len);
+extern int khttpd_stream_end(struct http_request *request);
+#endif
@@ -1,29 +1,77 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/cpuhotplug.h>
+#include <linux/debugfs.h>
+#include <linux/inet.h>
 #include <linux/kthread.h>
-#include <linux/mempool.h>
+#include <linux/percpu.h>
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/tcp.h>
+#include <linux/un.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #include <net/sock.h>
 
+#include "access_log.h"
+#include "http_cache.h"
+#include "http_file.h"
+#include "http_limit.h"
+#include "http_proxy.h"
+#include "http_response.h"
+#include "http_route.h"
 #include "http_server.h"
+#include "http_stats.h"
 
 #define DEFAULT_PORT 8081
 #define DEFAULT_BACKLOG 100
-#define POOL_MIN_NR 4
+#define DEFAULT_WORKERS 256
+#define MAX_LISTEN 8
 
-mempool_t *http_buf_pool;
+struct workqueue_struct *khttpd_wq;
 
 static ushort port = DEFAULT_PORT;
 module_param(port, ushort, S_IRUGO);
+static char *listen = "";
+module_param(listen, charp, S_IRUGO);
+MODULE_PARM_DESC(listen,
+                 "comma-separated addresses to listen on, instead of port");
 static ushort backlog = DEFAULT_BACKLOG;
 module_param(backlog, ushort, S_IRUGO);
+static ushort workers = DEFAULT_WORKERS;
+module_param(workers, ushort, S_IRUGO);
+MODULE_PARM_DESC(workers, "max connections processed concurrently per CPU");
+static bool reuseport;
+module_param(reuseport, bool, S_IRUGO);
+MODULE_PARM_DESC(reuseport, "one SO_REUSEPORT listener per online CPU");
+static char *docroot = "";
+module_param(docroot, charp, S_IRUGO);
+MODULE_PARM_DESC(docroot, "directory to serve files from");
+static char *backend = "";
+module_param(backend, charp, S_IRUGO);
+MODULE_PARM_DESC(backend, "host:port or Unix socket to forward requests to");
 
-static struct socket *listen_socket;
-static struct http_server_param param;
-static struct task_struct *http_server;
+struct khttpd_addr {
+    struct sockaddr_storage addr;
+    int len;
+};
+
+/* A listen socket together with the daemon accepting on it */
+struct khttpd_listener {
+    struct socket *socket;
+    struct http_server_param param;
+    struct task_struct *thread;
+};
+
+/* Each address gets one listener, or with reuseport one per CPU; Unix
+ * sockets can't share their address, so they always get a single one.
+ */
+static struct khttpd_addr addrs[MAX_LISTEN];
+static unsigned int nr_addrs;
+static struct khttpd_listener listeners[MAX_LISTEN];
+static DEFINE_PER_CPU(struct khttpd_listener[MAX_LISTEN], cpu_listeners);
+static enum cpuhp_state cpuhp_state;
+static struct dentry *debugfs_dir;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
 static int set_sock_opt(struct socket *sock,
@@ -41,6 +89,9 @@ static int set_sock_opt(struct socket *sock,
     case SO_REUSEADDR:
         sock_set_reuseaddr(sock->sk);
         break;
+    case SO_REUSEPORT:
+        sock_set_reuseport(sock->sk);
+        break;
     case SO_RCVBUF:
         sock_set_rcvbuf(sock->sk, *(int *) optval);
         break;
@@ -95,28 +146,130 @@ static inline int setsockopt(struct socket *sock,
     return kernel_setsockopt(sock, level, optname, (char *) &opt, sizeof(opt));
 }
 
-static int open_listen_socket(ushort port, ushort backlog, struct socket **res)
+/* Parse "a.b.c.d:port", "[v6addr]:port", the path of a Unix socket, or
+ * "@name" for one in the abstract namespace. Returns the address length.
+ */
+static int parse_addr(const char *s, struct sockaddr_storage *addr)
+{
+    const char *end;
+    u16 num;
+
+    memset(addr, 0, sizeof(*addr));
+    if (s[0] == '/' || s[0] == '@') {
+        struct sockaddr_un *sun = (struct sockaddr_un *) addr;
+        size_t len = strlen(s);
+
+        if (len >= sizeof(sun->sun_path))
+            return -ENAMETOOLONG;
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, s, len);
+        /* abstract names start with a NUL and have none at the end */
+        if (s[0] == '@') {
+            sun->sun_path[0] = '\0';
+            return offsetof(struct sockaddr_un, sun_path) + len;
+        }
+        return offsetof(struct sockaddr_un, sun_path) + len + 1;
+    }
+    if (s[0] == '[') {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+
+        if (!in6_pton(s + 1, -1, sin6->sin6_addr.s6_addr, ']', &end) ||
+            end[1] != ':' || kstrtou16(end + 2, 10, &num) || !num)
+            return -EINVAL;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(num);
+        return sizeof(*sin6);
+    }
+    if (!in4_pton(s, -1, (u8 *) &((struct sockaddr_in *) addr)->sin_addr,
+                  ':', &end) ||
+        *end != ':' || kstrtou16(end + 1, 10, &num) || !num)
+        return -EINVAL;
+    ((struct sockaddr_in *) addr)->sin_family = AF_INET;
+    ((struct sockaddr_in *) addr)->sin_port = htons(num);
+    return sizeof(struct sockaddr_in);
+}
+
+/* Fill addrs from the listen parameter, or from port without it */
+static int parse_listen(void)
+{
+    char *list, *p, *s;
+    int err = 0;
+
+    if (!*listen) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) &addrs[0].addr;
+
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        sin->sin_port = htons(port);
+        addrs[0].len = sizeof(*sin);
+        nr_addrs = 1;
+        return 0;
+    }
+    list = p = kstrdup(listen, GFP_KERNEL);
+    if (!list)
+        return -ENOMEM;
+    while ((s = strsep(&p, ","))) {
+        if (!*s)
+            continue;
+        if (nr_addrs == MAX_LISTEN) {
+            pr_err("more than %d listen addresses\n", MAX_LISTEN);
+            err = -E2BIG;
+            break;
+        }
+        err = parse_addr(s, &addrs[nr_addrs].addr);
+        if (err < 0) {
+            pr_err("invalid listen address %s, err=%d\n", s, err);
+            break;
+        }
+        addrs[nr_addrs++].len = err;
+        err = 0;
+    }
+    kfree(list);
+    if (!err && !nr_addrs)
+        err = -EINVAL;
+    return err;
+}
+
+/* Whether @a gets a listener on every CPU */
+static bool addr_per_cpu(const struct khttpd_addr *a)
+{
+    return reuseport && a->addr.ss_family != AF_UNIX;
+}
+
+static int open_listen_socket(const struct khttpd_addr *a,
+                              ushort backlog,
+                              bool reuse_port,
+                              struct socket **res)
 {
+    int family = a->addr.ss_family;
     struct socket *sock;
-    struct sockaddr_in s;
 
-    int err = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
+    int err = sock_create(family, SOCK_STREAM,
+                          family == AF_UNIX ? 0 : IPPROTO_TCP, &sock);
     if (err < 0) {
         pr_err("sock_create() failure, err=%d\n", err);
         return err;
     }
 
-    err = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 1);
-    if (err < 0)
-        goto bail_setsockopt;
+    if (family != AF_UNIX) {
+        err = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 1);
+        if (err < 0)
+            goto bail_setsockopt;
 
-    err = setsockopt(sock, SOL_TCP, TCP_NODELAY, 1);
-    if (err < 0)
-        goto bail_setsockopt;
+        if (reuse_port) {
+            err = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, 1);
+            if (err < 0)
+                goto bail_setsockopt;
+        }
 
-    err = setsockopt(sock, SOL_TCP, TCP_CORK, 0);
-    if (err < 0)
-        goto bail_setsockopt;
+        err = setsockopt(sock, SOL_TCP, TCP_NODELAY, 1);
+        if (err < 0)
+            goto bail_setsockopt;
+
+        err = setsockopt(sock, SOL_TCP, TCP_CORK, 0);
+        if (err < 0)
+            goto bail_setsockopt;
+    }
 
     err = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, 1024 * 1024);
     if (err < 0)
@@ -126,11 +279,11 @@ static int open_listen_socket(ushort port, ushort backlog, struct socket **res)
     if (err < 0)
         goto bail_setsockopt;
 
-    memset(&s, 0, sizeof(s));
-    s.sin_family = AF_INET;
-    s.sin_addr.s_addr = htonl(INADDR_ANY);
-    s.sin_port = htons(port);
-    err = kernel_bind(sock, (struct sockaddr *) &s, sizeof(s));
+    /* [::] takes IPv4 connections too, whatever net.ipv6.bindv6only says */
+    if (family == AF_INET6)
+        sock->sk->sk_ipv6only = false;
+
+    err = kernel_bind(sock, (struct sockaddr *) &a->addr, a->len);
     if (err < 0) {
         pr_err("kernel_bind() failure, err=%d\n", err);
         goto bail_sock;
@@ -157,33 +310,206 @@ static void close_listen_socket(struct socket *socket)
     sock_release(socket);
 }
 
-static int __init khttpd_init(void)
+/* Open a listen socket on @a and start its daemon, bound to @cpu unless it
+ * is -1
+ */
+static int start_listener(struct khttpd_listener *l,
+                          const struct khttpd_addr *a,
+                          int cpu)
 {
-    if (!(http_buf_pool = mempool_create(POOL_MIN_NR, http_buf_alloc,
-                                         http_buf_free, NULL))) {
-        pr_err("failed to create mempool\n");
-        return -ENOMEM;
-    }
-    int err = open_listen_socket(port, backlog, &listen_socket);
+    int err = open_listen_socket(a, backlog, cpu >= 0, &l->socket);
     if (err < 0) {
         pr_err("can't open listen socket\n");
         return err;
     }
-    param.listen_socket = listen_socket;
-    http_server = kthread_run(http_server_daemon, &param, KBUILD_MODNAME);
-    if (IS_ERR(http_server)) {
+    l->param.listen_socket = l->socket;
+    l->param.cpu = cpu;
+    if (cpu >= 0)
+        l->thread = kthread_create(http_server_daemon, &l->param,
+                                   KBUILD_MODNAME "/%d", cpu);
+    else
+        l->thread = kthread_create(http_server_daemon, &l->param,
+                                   KBUILD_MODNAME);
+    if (IS_ERR(l->thread)) {
         pr_err("can't start http server daemon\n");
-        close_listen_socket(listen_socket);
-        return PTR_ERR(http_server);
+        close_listen_socket(l->socket);
+        return PTR_ERR(l->thread);
     }
+    if (cpu >= 0)
+        kthread_bind(l->thread, cpu);
+    wake_up_process(l->thread);
     return 0;
 }
 
+static void stop_listener(struct khttpd_listener *l)
+{
+    if (!l->thread)
+        return;
+    send_sig(SIGTERM, l->thread, 1);
+    kthread_stop(l->thread);
+    close_listen_socket(l->socket);
+    l->thread = NULL;
+}
+
+static void stop_cpu_listeners(unsigned int cpu)
+{
+    struct khttpd_listener *l = *per_cpu_ptr(&cpu_listeners, cpu);
+
+    for (unsigned int i = 0; i < nr_addrs; i++)
+        stop_listener(&l[i]);
+}
+
+static int khttpd_cpu_online(unsigned int cpu)
+{
+    struct khttpd_listener *l = *per_cpu_ptr(&cpu_listeners, cpu);
+
+    for (unsigned int i = 0; i < nr_addrs; i++) {
+        int err;
+
+        if (!addr_per_cpu(&addrs[i]))
+            continue;
+        err = start_listener(&l[i], &addrs[i], cpu);
+        if (err < 0) {
+            stop_cpu_listeners(cpu);
+            return err;
+        }
+    }
+    return 0;
+}
+
+static int khttpd_cpu_offline(unsigned int cpu)
+{
+    /* connections still queued on these listeners are reset by the stack */
+    stop_cpu_listeners(cpu);
+    return 0;
+}
+
+static void stop_listeners(void)
+{
+    if (cpuhp_state)
+        cpuhp_remove_state(cpuhp_state);
+    cpuhp_state = 0;
+    for (unsigned int i = 0; i < nr_addrs; i++)
+        stop_listener(&listeners[i]);
+}
+
+static int start_listeners(void)
+{
+    bool per_cpu = false;
+
+    for (unsigned int i = 0; i < nr_addrs; i++) {
+        int err;
+
+        if (addr_per_cpu(&addrs[i])) {
+            per_cpu = true;
+            continue;
+        }
+        err = start_listener(&listeners[i], &addrs[i], -1);
+        if (err < 0) {
+            stop_listeners();
+            return err;
+        }
+    }
+    if (per_cpu) {
+        /* invokes khttpd_cpu_online() on every CPU now and on hotplug */
+        int err = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN,
+                                    KBUILD_MODNAME ":online",
+                                    khttpd_cpu_online, khttpd_cpu_offline);
+        if (err < 0) {
+            stop_listeners();
+            return err;
+        }
+        cpuhp_state = err;
+    }
+    return 0;
+}
+
+static int __init khttpd_init(void)
+{
+    struct sockaddr_storage backend_addr;
+    int backend_len = 0;
+    int err;
+
+    err = parse_listen();
+    if (err < 0)
+        return err;
+    if (*backend) {
+        backend_len = parse_addr(backend, &backend_addr);
+        if (backend_len < 0) {
+            pr_err("invalid backend %s, err=%d\n", backend, backend_len);
+            return backend_len;
+        }
+    }
+
+    err = http_server_init();
+    if (err < 0) {
+        pr_err("failed to create slab caches\n");
+        return err;
+    }
+    /* Work items only run while their connection has data to process, so
+     * max_active bounds busy connections per CPU, not open ones.
+     */
+    khttpd_wq = alloc_workqueue(KBUILD_MODNAME, 0, workers);
+    if (!khttpd_wq) {
+        pr_err("failed to create workqueue\n");
+        err = -ENOMEM;
+        goto err_server_exit;
+    }
+    debugfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+    http_stats_init(debugfs_dir);
+    err = access_log_init(debugfs_dir);
+    if (err < 0)
+        goto err_access_log_exit;
+    err = http_cache_init();
+    if (err < 0)
+        goto err_access_log_exit;
+    err = http_file_init(docroot);
+    if (err < 0)
+        goto err_cache_exit;
+    if (backend_len) {
+        http_proxy_init((struct sockaddr *) &backend_addr, backend_len);
+        pr_info("forwarding to backend %s\n", backend);
+    }
+    err = http_limit_init();
+    if (err < 0)
+        goto err_proxy_exit;
+    http_response_init();
+    err = start_listeners();
+    if (err < 0)
+        goto err_response_exit;
+    return 0;
+
+err_response_exit:
+    http_response_exit();
+    http_limit_exit();
+err_proxy_exit:
+    http_proxy_exit();
+    http_file_exit();
+err_cache_exit:
+    http_cache_exit();
+err_access_log_exit:
+    debugfs_remove_recursive(debugfs_dir);
+    access_log_exit();
+    destroy_workqueue(khttpd_wq);
+err_server_exit:
+    http_server_exit();
+    return err;
+}
+
 static void __exit khttpd_exit(void)
 {
-    send_sig(SIGTERM, http_server, 1);
-    kthread_stop(http_server);
-    close_listen_socket(listen_socket);
+    stop_listeners();
+    http_server_close_conns();
+    destroy_workqueue(khttpd_wq);
+    http_route_exit();
+    http_response_exit();
+    http_limit_exit();
+    http_proxy_exit();
+    http_cache_exit();
+    http_file_exit();
+    debugfs_remove_recursive(debugfs_dir);
+    access_log_exit();
+    http_server_exit();
     pr_info("module unloaded\n");
 }
 
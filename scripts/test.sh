@@ -7,13 +7,18 @@ if [ "$EUID" -eq 0 ]
   exit
 fi
 
-# load kHTTPd
+# load kHTTPd on a dual-stack TCP port and an abstract Unix socket
 sudo rmmod -f khttpd 2>/dev/null
 sleep 1
-sudo insmod $KHTTPD_MOD
+sudo insmod $KHTTPD_MOD listen='[::]:8081,@khttpd'
 
-# run HTTP benchmarking
-./htstress -n 100000 -c 1 -t 4 http://localhost:8081/
+# run HTTP benchmarking over each transport
+echo "TCP over IPv4:"
+./htstress -n 100000 -c 1 -t 4 -4 http://localhost:8081/
+echo "TCP over IPv6:"
+./htstress -n 100000 -c 1 -t 4 -6 http://localhost:8081/
+echo "Unix domain socket:"
+./htstress -n 100000 -c 1 -t 4 -u @khttpd http://localhost/
 
 # epilogue
 sudo rmmod khttpd